@@ -0,0 +1,113 @@
+
+#include <string.h>
+
+#include "compress.h"
+
+/*
+The stream is a sequence of items, each starting with a control byte c.
+c < 32: a run of c+1 literal bytes follows.
+Otherwise a back reference: length (c>>5)+2, plus one more byte when
+c>>5 is 7; then the low byte of the distance, whose high bits are c&31.
+Distances count back from the current output position, minus one.
+*/
+
+#define HASH_BITS    12
+#define MAX_LITERALS 32
+#define MAX_DISTANCE 8192
+#define MAX_MATCH    (7 + 255 + 2)
+
+static unsigned hash3( const unsigned char *p )
+{
+	unsigned v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+int lz_compress( const char *src, int length, char *dst, int max )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int table[1 << HASH_BITS];
+	int ip = 0, op = 0, lit = 0;
+	int ref, len, limit, dist, i;
+
+	for(i=0;i<(1<<HASH_BITS);i++) table[i] = -1;
+
+	while(ip<length) {
+		ref = -1;
+		if(ip+2<length) {
+			unsigned h = hash3(in+ip);
+			ref = table[h];
+			table[h] = ip;
+		}
+		if(ref>=0 && ip-ref<=MAX_DISTANCE && !memcmp(in+ref,in+ip,3)) {
+			limit = length-ip < MAX_MATCH ? length-ip : MAX_MATCH;
+			for(len=3;len<limit && in[ref+len]==in[ip+len];len++);
+
+			if(lit) {
+				if(op+1+lit>max) return 0;
+				out[op++] = lit-1;
+				memcpy(out+op,in+ip-lit,lit);
+				op += lit;
+				lit = 0;
+			}
+			dist = ip-ref-1;
+			if(op+3>max) return 0;
+			if(len-2<7) {
+				out[op++] = ((len-2)<<5) | (dist>>8);
+			} else {
+				out[op++] = (7<<5) | (dist>>8);
+				out[op++] = len-2-7;
+			}
+			out[op++] = dist & 0xff;
+			ip += len;
+		} else {
+			ip++;
+			if(++lit==MAX_LITERALS) {
+				if(op+1+lit>max) return 0;
+				out[op++] = lit-1;
+				memcpy(out+op,in+ip-lit,lit);
+				op += lit;
+				lit = 0;
+			}
+		}
+	}
+	if(lit) {
+		if(op+1+lit>max) return 0;
+		out[op++] = lit-1;
+		memcpy(out+op,in+ip-lit,lit);
+		op += lit;
+	}
+	return op;
+}
+
+int lz_decompress( const char *src, int length, char *dst, int max )
+{
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	int ip = 0, op = 0;
+	int c, len, ref;
+
+	while(ip<length) {
+		c = in[ip++];
+		if(c<MAX_LITERALS) {
+			len = c+1;
+			if(ip+len>length || op+len>max) return -1;
+			memcpy(out+op,in+ip,len);
+			ip += len;
+			op += len;
+		} else {
+			len = c>>5;
+			if(len==7) {
+				if(ip>=length) return -1;
+				len += in[ip++];
+			}
+			len += 2;
+			if(ip>=length) return -1;
+			ref = op - ((c&31)<<8) - in[ip++] - 1;
+			if(ref<0 || op+len>max) return -1;
+			// the source may overlap what is being written
+			while(len--) out[op++] = out[ref++];
+		}
+	}
+	return op;
+}
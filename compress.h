@@ -0,0 +1,14 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*
+A small LZ77 byte compressor for file clusters. lz_compress returns the
+compressed length, or 0 if the output would not fit in max bytes.
+lz_decompress returns the number of bytes produced, or -1 if the input
+is damaged or would overflow max.
+*/
+
+int lz_compress( const char *src, int length, char *dst, int max );
+int lz_decompress( const char *src, int length, char *dst, int max );
+
+#endif
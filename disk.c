@@ -4,44 +4,103 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+// the Linux limit, when the headers do not say
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+Reads and writes use pread/pwrite so that threads sharing a disk never
+race on a file position, and the counters are updated atomically.
+
+A disk is created with nblocks of DISK_BLOCK_SIZE bytes; the filesystem
+may later switch it to larger blocks, which divides the same bytes into
+fewer blocks.
+
+To model a rotating disk, every access that does not start at the block
+after the previous one counts as a seek.
+*/
+
+struct disk {
+	int fd;
+	off_t nbytes;
+	int blocksize;
+	int nblocks;
+	int nreads;
+	int nwrites;
+	int nseeks;
+	int last;
+};
+
+struct disk * disk_init( const char *filename, int n )
+{
+	struct disk *d = malloc(sizeof(struct disk));
+	if(!d) return 0;
+
+	d->fd = open(filename,O_RDWR|O_CREAT,0666);
+	if(d->fd<0) {
+		free(d);
+		return 0;
+	}
+
+	d->nbytes = (off_t)n*DISK_BLOCK_SIZE;
+	ftruncate(d->fd,d->nbytes);
+
+	d->blocksize = DISK_BLOCK_SIZE;
+	d->nblocks = n;
+	d->nreads = 0;
+	d->nwrites = 0;
+	d->nseeks = 0;
+	d->last = -1;
+
+	return d;
+}
 
-int disk_init( const char *filename, int n )
+int disk_size( struct disk *d )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return d->nblocks;
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+int disk_blocksize( struct disk *d )
+{
+	return d->blocksize;
+}
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+int disk_set_blocksize( struct disk *d, int blocksize )
+{
+	if(blocksize<DISK_BLOCK_SIZE || blocksize>DISK_MAX_BLOCK_SIZE || (blocksize&(blocksize-1))) {
+		return 0;
+	}
+
+	d->blocksize = blocksize;
+	d->nblocks = d->nbytes/blocksize;
 
 	return 1;
 }
 
-int disk_size()
+static void count_seek( struct disk *d, int blocknum, int count )
 {
-	return nblocks;
+	int last = __sync_lock_test_and_set(&d->last,blocknum+count-1);
+	if(blocknum!=last && blocknum!=last+1) {
+		__sync_fetch_and_add(&d->nseeks,1);
+	}
 }
 
-static void sanity_check( int blocknum, const void *data )
+static void sanity_check( struct disk *d, int blocknum, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
+	if(blocknum>=d->nblocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
 		abort();
 	}
@@ -52,41 +111,142 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+void disk_read( struct disk *d, int blocknum, char *data )
+{
+	sanity_check(d,blocknum,data);
+	count_seek(d,blocknum,1);
+
+	if(pread(d->fd,data,d->blocksize,(off_t)blocknum*d->blocksize)==d->blocksize) {
+		__sync_fetch_and_add(&d->nreads,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+void disk_write( struct disk *d, int blocknum, const char *data )
+{
+	sanity_check(d,blocknum,data);
+	count_seek(d,blocknum,1);
+
+	if(pwrite(d->fd,data,d->blocksize,(off_t)blocknum*d->blocksize)==d->blocksize) {
+		__sync_fetch_and_add(&d->nwrites,1);
+	} else {
+		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		abort();
+	}
+}
+
+/*
+Read or write count consecutive blocks starting at blocknum with a single
+system call. Each block still counts as one read or write.
+*/
+
+void disk_read_blocks( struct disk *d, int blocknum, int count, char *data )
 {
-	sanity_check(blocknum,data);
+	ssize_t length = (ssize_t)count*d->blocksize;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+	count_seek(d,blocknum,count);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(pread(d->fd,data,length,(off_t)blocknum*d->blocksize)==length) {
+		__sync_fetch_and_add(&d->nreads,count);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_write( int blocknum, const char *data )
+void disk_write_blocks( struct disk *d, int blocknum, int count, const char *data )
 {
-	sanity_check(blocknum,data);
+	ssize_t length = (ssize_t)count*d->blocksize;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+	count_seek(d,blocknum,count);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(pwrite(d->fd,data,length,(off_t)blocknum*d->blocksize)==length) {
+		__sync_fetch_and_add(&d->nwrites,count);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_close()
+/*
+The same for buffers scattered in memory: iov[0..iovcnt) must add up to
+exactly count blocks. Lists longer than the system allows in one call are
+issued in pieces.
+*/
+
+static void disk_vector( struct disk *d, int blocknum, int count, const struct iovec *iov, int iovcnt, int write )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	off_t offset = (off_t)blocknum*d->blocksize;
+	ssize_t length, done;
+	int i, n;
+
+	sanity_check(d,blocknum,iov);
+	sanity_check(d,blocknum+count-1,iov);
+
+	for(length=0, i=0; i<iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	if(length!=(ssize_t)count*d->blocksize) {
+		printf("ERROR: iovec length (%ld) is not %d blocks!\n",(long)length,count);
+		abort();
+	}
+	count_seek(d,blocknum,count);
+
+	while(iovcnt>0) {
+		n = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+		for(length=0, i=0; i<n; i++) {
+			length += iov[i].iov_len;
+		}
+		done = write ? pwritev(d->fd,iov,n,offset) : preadv(d->fd,iov,n,offset);
+		if(done!=length) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+		offset += length;
+		iov += n;
+		iovcnt -= n;
 	}
+
+	__sync_fetch_and_add(write ? &d->nwrites : &d->nreads,count);
+}
+
+void disk_readv( struct disk *d, int blocknum, int count, const struct iovec *iov, int iovcnt )
+{
+	disk_vector(d,blocknum,count,iov,iovcnt,0);
+}
+
+void disk_writev( struct disk *d, int blocknum, int count, const struct iovec *iov, int iovcnt )
+{
+	disk_vector(d,blocknum,count,iov,iovcnt,1);
+}
+
+int disk_nreads( struct disk *d )
+{
+	return d->nreads;
+}
+
+int disk_nwrites( struct disk *d )
+{
+	return d->nwrites;
+}
+
+int disk_nseeks( struct disk *d )
+{
+	return d->nseeks;
 }
 
+void disk_close( struct disk *d )
+{
+	if(d) {
+		printf("%d disk block reads\n",d->nreads);
+		printf("%d disk block writes\n",d->nwrites);
+		close(d->fd);
+		free(d);
+	}
+}
@@ -1,13 +1,27 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <sys/uio.h>
+
 #define DISK_BLOCK_SIZE 4096
+#define DISK_MAX_BLOCK_SIZE 65536
+
+struct disk;
 
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *data );
-void disk_write( int blocknum, const char *data );
-void disk_close();
+struct disk * disk_init( const char *filename, int nblocks );
+int  disk_size( struct disk *d );
+int  disk_blocksize( struct disk *d );
+int  disk_set_blocksize( struct disk *d, int blocksize );
+void disk_read( struct disk *d, int blocknum, char *data );
+void disk_write( struct disk *d, int blocknum, const char *data );
+void disk_read_blocks( struct disk *d, int blocknum, int count, char *data );
+void disk_write_blocks( struct disk *d, int blocknum, int count, const char *data );
+void disk_readv( struct disk *d, int blocknum, int count, const struct iovec *iov, int iovcnt );
+void disk_writev( struct disk *d, int blocknum, int count, const struct iovec *iov, int iovcnt );
+int  disk_nreads( struct disk *d );
+int  disk_nwrites( struct disk *d );
+int  disk_nseeks( struct disk *d );
+void disk_close( struct disk *d );
 
 
 #endif
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE         // sched_getcpu
+
 #include "fs.h"
 #include "disk.h"
+#include "pool.h"
+#include "compress.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -7,94 +11,582 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <limits.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
 
-int MOUNTED = 0; 
-int * BITMAP; 
-int * BLOCK_BITMAP; 
-int * INODE_BITMAP; 
-int * INUMBERS;
-int NBLOCKS; 
-int CURR_BLOCK; 
-int * NEXT_AVAILABLE; 
+// per-block counts depend on the block size chosen at format time; this is the ceiling
+#define MAX_POINTERS_PER_BLOCK (DISK_MAX_BLOCK_SIZE / sizeof(int))
+
+// on-disk inode sizes; anything past the 32-byte header is inline data space
+#define MIN_INODE_SIZE     32
+#define MAX_INODE_SIZE     256
+
+// isvalid holds flags; 0 is a free inode
+#define INODE_VALID        1
+#define INODE_INLINE       2    // contents are stored in the inode, no blocks are mapped
+#define INODE_COMPRESSED   4    // contents are stored as compressed clusters
+
+/*
+A compressed file is split into clusters of CLUSTER_BLOCKS logical blocks
+and each cluster takes the same run of pointer slots it would uncompressed.
+A cluster stored in fewer blocks leaves the trailing slots 0 and starts
+with its compressed length; one using every slot is stored as is, and one
+using none is a hole.
+*/
+#define CLUSTER_BLOCKS     4
+
+#define INODE_NAMED        8    // has a directory entry; removed by fs_unlink, not fs_delete
+#define INODE_DIRECTORY    16   // the name index itself
+
+/*
+Deleted, but its blocks are not freed yet. The inode keeps its pointers
+and its slot until the reclaimer thread frees them, so a crash in
+between leaves nothing leaked: mount finds the inode and queues it
+again. Everything but the reclaimer sees it as a free inode.
+*/
+#define INODE_ORPHAN       32
+
+#define DIR_MAX_DEPTH      16   // table entries are 16 bits, so never more buckets than that
+
+#define INODE_FLAGS        (INODE_VALID | INODE_INLINE | INODE_COMPRESSED | INODE_NAMED | INODE_DIRECTORY | INODE_ORPHAN)
+
+/*
+An inumber is its inode's position: slot s of the table, in block
+s / inodes_per_block + 1, is inumber s + FIRST_INUMBER, on every mount.
+0 and 1 are never files.
+*/
+#define FIRST_INUMBER      2
+
+// inode and inode-table locks are striped: inumber (or block) modulo the count
+#define INODE_LOCKS        256
+#define ITABLE_LOCKS       64
+
+// dedup keeps at most one indexed block per hash value; 0 marks an unindexed block
+#define DEDUP_NONE         0
+
+// reads spanning this many blocks are spread over a pool of workers
+#define PARALLEL_READ_BLOCKS 16
+#define READ_WORKERS         8
+
+/*
+A run of free blocks outside any allocation window. Each group keeps
+its extents in a treap ordered by start, where every node also records
+the longest extent below it, so the first extent of at least n blocks
+after a given block is found without visiting the rest.
+*/
+struct fs_extent {
+    int start; 
+    int length; 
+    int longest;            // longest extent in this subtree
+    unsigned priority;      // heap order, larger nearer the root
+    struct fs_extent *left; 
+    struct fs_extent *right; 
+};
+
+/*
+A small open-addressing hash map from int to int, for tables that only
+have entries for a few of the blocks or inodes. Keys are stored plus
+one, so calloc'd keys are empty slots.
+*/
+struct fs_intmap {
+    int *keys; 
+    int *values; 
+    int size;               // power of two, or 0 before the first entry
+    int count; 
+};
+
+/*
+The data area and the inode table are each split into ngroups equal
+ranges, group g owning the g-th of both. Groups are only described by
+their count in the superblock; the free maps and counters are built at
+mount. Each group has its own lock, so threads allocating from
+different groups never wait on each other.
+*/
+struct fs_group {
+    pthread_mutex_t lock;   // everything below that changes after mount
+    int first_block;        // data blocks first_block..end_block-1
+    int end_block; 
+    int first_slot;         // inode table slots first_slot..end_slot-1
+    int end_slot; 
+    int free_blocks;        // including those in allocation windows
+    uint64_t *used;         // bit per block, set while anything refers to it
+    struct fs_intmap shared;    // block -> references beyond the first, for shared blocks only
+    struct fs_intmap windows;   // window number -> inumber it is reserved for
+    struct fs_extent *extents; 
+    uint64_t *free_slot_map;    // bit per slot, set while free
+    int free_slots;         // orphans hold theirs until they are reclaimed
+    int slot_hint;          // no free slot below this one
+};
+
+// everything a mounted image needs; one per image, nothing is shared
+struct fs {
+    struct disk *disk; 
+    int mounted; 
+    int nblocks; 
+    int ninodes; 
+    int blocksize; 
+    int inodesize; 
+    int inline_size;        // bytes of file data an inline inode can hold
+    int inodes_per_block; 
+    int pointers_per_block; 
+    int first_data_block;   // everything below is superblock, inode table or hash index
+    struct fs_intmap file_windows;  // inumber -> start of its allocation window, guarded by window_lock
+
+    struct fs_group *groups; 
+    int ngroups; 
+
+    // dedup index, only on images formatted with one; guarded by dedup_lock
+    int hashblocks;         // blocks after the inode table holding block_hash
+    uint32_t *block_hash;   // block -> content hash if indexed, else DEDUP_NONE
+    int *hash_next;         // block -> next block in the same bucket
+    int *hash_heads;        // bucket -> first block, 0 for none
+    int nbuckets;           // power of two
+    int dedup_saved;        // block writes avoided since mount
+
+    /*
+    Lock order: inode lock, then itable lock or an allocator lock. Of the
+    allocator locks only a group lock and then dedup_lock or window_lock
+    are ever held together, and never two group locks.
+    */
+    pthread_rwlock_t inode_locks[INODE_LOCKS];     // file contents and inode fields
+    pthread_mutex_t itable_locks[ITABLE_LOCKS];    // read-modify-write of an inode block
+    pthread_mutex_t dedup_lock;                    // the dedup index
+    pthread_mutex_t window_lock;                   // file_windows
+
+    pthread_rwlock_t dir_lock;                     // the directory; taken before any inode lock
+    int dir_inumber;                               // 0 until the first name is created
+
+    pthread_mutex_t defrag_lock;                   // one defrag pass at a time
+    int defrag_next;                               // inumber the next pass starts at
+
+    struct pool *read_pool;                        // started by the first large read
+    pthread_mutex_t read_pool_lock; 
+
+    /*
+    Deleted inodes waiting for the reclaimer, at most one per slot. It
+    takes no inode locks, as nothing else can see an orphan, so callers
+    holding one may wait for it to finish.
+    */
+    pthread_mutex_t orphan_lock;                   // everything below
+    pthread_cond_t orphan_cond;                    // work for the reclaimer, or it went idle
+    int *orphans; 
+    int norphans; 
+    int reclaiming;                                // orphans taken off the list but not freed yet
+    int reclaimed;                                 // batches freed so far; read without the lock
+    int reclaim_stop;                              // set by unmount once the list may drain
+    int reclaimer_started; 
+    pthread_t reclaimer; 
+};
+
+// format makes a group per this many data blocks, up to MAX_GROUPS
+#define GROUP_BLOCKS       1024
+#define MAX_GROUPS         64
+
+// a growing file reserves this many free blocks ahead of itself, aligned within its group
+#define ALLOC_WINDOW       32
+
+// the reclaimer frees up to this many orphans at a time
+#define RECLAIM_BATCH      256
+
+// fs_scan reads a file this many blocks at a time
+#define SCAN_BLOCKS        64
+
+// defrag copies a file this many blocks at a time
+#define DEFRAG_CHUNK       64
+
+// fsck hands the inode table to the read pool this many inode blocks at a time
+#define FSCK_RANGE         16
+#define FSCK_NONE          0x7fffffff
+
+/*
+What fs_fsck learns about an unmounted image. The workers share refs and
+owner and update them atomically; each inode block, and each indirect
+block it owns, is only ever touched by one worker.
+*/
+struct fsck_state {
+    struct fs *fs; 
+    int repair; 
+    int pass;               // 1 checks and counts, 2 repairs
+    int ninodeblocks; 
+    int first_data_block; 
+    int *refs;              // block -> pointers to it seen in pass 1
+    int *kept;              // block -> pointers to it left after pass 2
+    int *owner;             // block -> lowest slot using it as an indirect block, FSCK_NONE if none
+    char *named;            // slot -> 1 if flagged INODE_NAMED, 2 once a directory entry names it
+    int inodes;             // valid inodes seen in pass 1
+    int problems; 
+};
+
+// one fs_read call, split into per-block pieces for read_one_block
+struct read_request {
+    struct fs *fs; 
+    int *blocks;        // disk block of each file block in the range, 0 for a hole
+    int first;          // file block number of blocks[0]
+    char *data; 
+    int offset; 
+    int length; 
+};
+
+/*
+A position in the buffers passed to fs_readv or fs_writev. A run of disk
+blocks is read or written as one vector that points straight into them,
+with a spare block standing in for any part of a block outside the range.
+*/
+struct iov_cursor {
+    const struct iovec *iov; 
+    int iovcnt; 
+    int index;          // current buffer
+    size_t skip;        // bytes of it already used
+};
 
 struct fs_superblock {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int blocksize;      // 0 on images formatted before block sizes were configurable
+    int inodesize;      // 0 likewise, meaning MIN_INODE_SIZE
+    int hashblocks;     // size of the dedup index after the inode table, 0 without dedup
+    int dirslot;        // inode table slot of the directory plus one, 0 if there is none
+    int ngroups;        // block groups, 0 on images formatted before there were several
+    int free_blocks;    // free data blocks plus one as of the last unmount; 0 while mounted or if unknown
+    int free_inodes;    // free inode table slots plus one, likewise
+};
+
+/*
+The directory is one file holding an extendible hash of names. File block
+0 is the header: the global depth, how many file blocks are in use, and a
+table of 2^depth bucket block numbers indexed by the low bits of the name
+hash. Every other block is a bucket. Entries name an inode table slot,
+which unlike an inumber does not change across mounts.
+
+The directory is a file like any other, so it has at most the blocks an
+inode can address, and the table must fit in the header. That caps it at
+about 130,000 names with 4 KB blocks (1024 buckets of 127), fewer in
+practice as buckets split before they fill, and at millions with 64 KB
+blocks. Past that, naming a file fails and says so; see dir_capacity.
+*/
+struct fs_dirent {
+    int slot;
+    char name[FS_NAME_MAX + 1];
+};
+
+struct fs_dir_header {
+    int depth;
+    int nblocks;
+    unsigned short table[(DISK_MAX_BLOCK_SIZE - 2 * sizeof(int)) / sizeof(unsigned short)];
+};
+
+struct fs_dir_bucket {
+    int depth;          // low bits of the hash shared by every entry in here
+    int count;
+    struct fs_dirent entries[(DISK_MAX_BLOCK_SIZE - 2 * sizeof(int)) / sizeof(struct fs_dirent)];
 };
 
+/*
+Only the first fs->inodesize bytes of this are stored on disk. An inline
+inode keeps its contents in data, over the block pointers.
+*/
 struct fs_inode {
     int isvalid;
     int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
+    union {
+        struct {
+            int direct[POINTERS_PER_INODE];
+            int indirect;
+        };
+        char data[MAX_INODE_SIZE - 2 * sizeof(int)];
+    };
 };
 
 union fs_block {
     struct fs_superblock super;
-    struct fs_inode inode[INODES_PER_BLOCK];
-    int pointers[POINTERS_PER_BLOCK];
-    char data[DISK_BLOCK_SIZE];
+    struct fs_dir_header header;
+    struct fs_dir_bucket bucket;
+    int pointers[MAX_POINTERS_PER_BLOCK];
+    char data[DISK_MAX_BLOCK_SIZE];
 };
 
-void inode_load(int inumber, struct fs_inode *inode); 
-void inode_save(int inumber, struct fs_inode *inode); 
-int determine_block(int inumber, int offset); 
-int get_NEXT_AVAILABLE();
-void release_inumber(int inumber);
+static int inode_load(struct fs *fs, int inumber, struct fs_inode *inode); 
+static void inode_save(struct fs *fs, int inumber, struct fs_inode *inode); 
+static int determine_block(struct fs *fs, int offset); 
+static int load_geometry(struct fs *fs, union fs_block *block); 
+static void set_geometry(struct fs *fs, int blocksize, int inodesize); 
+static struct fs_inode * inode_slot(struct fs *fs, union fs_block *block, int slot); 
+static int write_blocks(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset); 
+static int get_NEXT_AVAILABLE(struct fs *fs, int goal, int inumber);
+static int get_NEXT_AVAILABLE_run(struct fs *fs, int count, int goal);
+static int find_reserved(struct fs_group *group, int from); 
+static void claim_blocks(struct fs_group *group, int start, int count); 
+static void extent_free(struct fs_group *group, int start, int length); 
+static void extent_take(struct fs_group *group, int start, int length); 
+static int extent_find(struct fs_group *group, int from, int count, int align); 
+static void extent_destroy(struct fs_extent *e); 
+static struct fs_group * block_group(struct fs *fs, int blocknum); 
+static int slot_group(struct fs *fs, int slot); 
+static void setup_groups(struct fs *fs, int ngroups); 
+static void fill_groups(struct fs *fs); 
+static int block_refs(struct fs_group *group, int blocknum); 
+static int block_ref(struct fs_group *group, int blocknum); 
+static int block_unref(struct fs_group *group, int blocknum); 
+static int intmap_get(struct fs_intmap *m, int key, int missing); 
+static int intmap_put(struct fs_intmap *m, int key, int value); 
+static void intmap_remove(struct fs_intmap *m, int key); 
+static void intmap_free(struct fs_intmap *m); 
+static int bit_get(const uint64_t *map, int i); 
+static void bit_put(uint64_t *map, int i, int value); 
+static int bit_find(const uint64_t *map, int from, int end, int value); 
+static void drop_window(struct fs *fs, int inumber); 
+static int inode_goal(struct fs *fs, int inumber); 
+static int inline_to_blocks(struct fs *fs, int inumber, struct fs_inode *inode); 
+static int zero_range(struct fs *fs, int inumber, struct fs_inode *inode, int from, int to); 
+static int put_blocks(struct fs *fs, int inumber, struct fs_inode *curr, const char *data, int length, int offset, int fill_holes); 
+static int own_block(struct fs *fs, int blocknum); 
+static int share_block(struct fs *fs, int blocknum); 
+static void unshare_blocks(struct fs *fs, const int *blocks, int n); 
+static uint32_t hash_block(const char *data, int length); 
+static int dedup_lookup(struct fs *fs, uint32_t hash, const char *data); 
+static void dedup_insert(struct fs *fs, int blocknum, uint32_t hash); 
+static void dedup_remove(struct fs *fs, int blocknum); 
+static void load_hashes(struct fs *fs); 
+static void store_hashes(struct fs *fs); 
+static void store_counts(struct fs *fs, int known); 
+static void release_tail(struct fs *fs, struct fs_inode *inode, int size); 
+static void release_inumber(struct fs *fs, int inumber);
+static void release_blocks(struct fs *fs, int *blocks, int n);
+static int compare_ints(const void *a, const void *b);
+static void release_tables(struct fs *fs);
+static int inode_read(struct fs *fs, int inumber, char *data, int length, int offset); 
+static int inode_write(struct fs *fs, int inumber, const char *data, int length, int offset); 
+static int write_contents(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset); 
+static int inode_readv(struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset); 
+static int inode_writev(struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset); 
+static int write_vector(struct fs *fs, int inumber, struct fs_inode *inode, struct iov_cursor *cursor, int length, int offset); 
+static int iov_total(const struct iovec *iov, int iovcnt); 
+static int cursor_next(struct iov_cursor *c, int max, char **base); 
+static void cursor_copy(struct iov_cursor *c, char *buf, const char *from, int length); 
+static void cursor_slices(struct iov_cursor *c, struct iovec *vec, int *nvec, int length); 
+static int pin_range(struct fs *fs, int inumber, int offset, int length, char *buffer, struct fs_blockref *refs); 
+static int inode_delete(struct fs *fs, int inumber); 
+static int free_inodes(struct fs *fs, int *sorted, int n, int orphans); 
+static void * reclaim_thread(void *arg); 
+static void start_reclaimer(struct fs *fs); 
+static void stop_reclaimer(struct fs *fs); 
+static int reclaim_generation(struct fs *fs); 
+static int reclaim_wait(struct fs *fs, int since); 
+static int inode_truncate(struct fs *fs, int inumber, int size); 
+static int inode_fallocate(struct fs *fs, int inumber, int size); 
+static void resolve_blocks(struct fs *fs, struct fs_inode *inode, int first, int nblocks, int *blocks); 
+static int map_blocks(struct fs *fs, struct fs_inode *inode, int first, int nblocks, const int *blocks, int *old); 
+static int cluster_load(struct fs *fs, const int *blocks, int cluster, char *buf); 
+static int cluster_store(struct fs *fs, struct fs_inode *inode, int cluster, char *buf, int length); 
+static int read_clusters(struct fs *fs, struct fs_inode *inode, char *data, int length, int offset); 
+static int write_clusters(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset); 
+static int truncate_clusters(struct fs *fs, struct fs_inode *inode, int size); 
+static void read_one_block(void *arg, int index); 
+static struct pool * get_read_pool(struct fs *fs); 
+static uint32_t hash_name(const char *name); 
+static void fsck_problem(struct fsck_state *st, const char *fmt, ...); 
+static int fsck_superblock(struct fsck_state *st, union fs_block *super); 
+static void fsck_image(struct fsck_state *st, union fs_block *super); 
+static void fsck_range(void *arg, int index); 
+static int fsck_inode(struct fsck_state *st, int slot, struct fs_inode *inode); 
+static int fsck_pointer(struct fsck_state *st, int slot, int index, int limit, int *pointer); 
+static void fsck_directory(struct fsck_state *st, union fs_block *super); 
+static void fsck_hashes(struct fsck_state *st); 
+static int count_runs(const int *blocks, int nblocks); 
+static int defrag_inode(struct fs *fs, int inumber, int budget, int *blocks, int *moved_to, char *buf); 
+static void copy_blocks(struct fs *fs, const int *from, int to, int count, char *buf); 
+static int dir_open(struct fs *fs); 
+static int dir_read(struct fs *fs, int fileblock, union fs_block *block); 
+static int dir_write(struct fs *fs, int fileblock, union fs_block *block); 
+static int dir_find(struct fs *fs, const char *name, union fs_block *bucket, int *fileblock); 
+static int dir_insert(struct fs *fs, const char *name, int slot); 
+static int dir_capacity(struct fs *fs); 
+static int slot_to_inumber(struct fs *fs, int slot); 
+static int slot_used(struct fs *fs, int slot); 
+static int set_named(struct fs *fs, int inumber, int named); 
+
+static pthread_rwlock_t * inode_lock(struct fs *fs, int inumber){
+    return &fs->inode_locks[(unsigned)inumber % INODE_LOCKS]; 
+}
+
+struct fs * fs_init( struct disk *d )
+{
+    int i; 
+    struct fs *fs = (struct fs *)calloc(1, sizeof(struct fs)); 
+    if(!fs){
+        return 0; 
+    }
+    fs->disk = d; 
+    for(i=0; i<INODE_LOCKS; i++){
+        pthread_rwlock_init(&fs->inode_locks[i], 0); 
+    }
+    for(i=0; i<ITABLE_LOCKS; i++){
+        pthread_mutex_init(&fs->itable_locks[i], 0); 
+    }
+    pthread_mutex_init(&fs->dedup_lock, 0); 
+    pthread_mutex_init(&fs->window_lock, 0); 
+    pthread_mutex_init(&fs->read_pool_lock, 0); 
+    pthread_rwlock_init(&fs->dir_lock, 0); 
+    pthread_mutex_init(&fs->defrag_lock, 0); 
+    pthread_mutex_init(&fs->orphan_lock, 0); 
+    pthread_cond_init(&fs->orphan_cond, 0); 
+    return fs; 
+}
+
+void fs_close( struct fs *fs )
+{
+    int i; 
+    if(!fs){
+        return; 
+    }
+    fs_unmount(fs); 
+    for(i=0; i<INODE_LOCKS; i++){
+        pthread_rwlock_destroy(&fs->inode_locks[i]); 
+    }
+    for(i=0; i<ITABLE_LOCKS; i++){
+        pthread_mutex_destroy(&fs->itable_locks[i]); 
+    }
+    pthread_mutex_destroy(&fs->dedup_lock); 
+    pthread_mutex_destroy(&fs->window_lock); 
+    pool_destroy(fs->read_pool); 
+    pthread_mutex_destroy(&fs->read_pool_lock); 
+    pthread_rwlock_destroy(&fs->dir_lock); 
+    pthread_mutex_destroy(&fs->defrag_lock); 
+    pthread_mutex_destroy(&fs->orphan_lock); 
+    pthread_cond_destroy(&fs->orphan_cond); 
+    free(fs); 
+}
+
+int fs_unmount( struct fs *fs )
+{
+    if(!fs->mounted){
+        return 0; 
+    }
+    stop_reclaimer(fs); 
+    store_counts(fs, 1); 
+    store_hashes(fs); 
+    release_tables(fs); 
+    fs->mounted = 0; 
+    return 1; 
+}
 
-int fs_format(){
+int fs_format( struct fs *fs, int blocksize, int inodesize, int dedup ){
 
     union fs_block block; 
-    int i, j; 
+    int i; 
 
-    if(MOUNTED){
+    if(fs->mounted){
         fprintf(stderr, "File system already mounted\n"); 
         return 0; 
     }
-    NBLOCKS = disk_size(); 
-    int blocks = NBLOCKS; 
+    if(blocksize == 0){
+        blocksize = DISK_BLOCK_SIZE; 
+    }
+    if(inodesize == 0){
+        inodesize = MIN_INODE_SIZE; 
+    }
+    if(inodesize < MIN_INODE_SIZE || inodesize > MAX_INODE_SIZE || (inodesize & (inodesize - 1))){
+        fprintf(stderr, "Inode size must be a power of two from %d to %d\n", MIN_INODE_SIZE, MAX_INODE_SIZE); 
+        return 0; 
+    }
+    if(!disk_set_blocksize(fs->disk, blocksize)){
+        fprintf(stderr, "Block size must be a power of two from %d to %d\n", DISK_BLOCK_SIZE, DISK_MAX_BLOCK_SIZE); 
+        return 0; 
+    }
+    set_geometry(fs, blocksize, inodesize); 
+
+    fs->nblocks = disk_size(fs->disk); 
+    int blocks = fs->nblocks; 
     int inode_blocks = (.9 + (.1 * blocks)); 
-    int k; 
+    // one hash per block
+    int hash_blocks = dedup ? (blocks * (int)sizeof(uint32_t) + fs->blocksize - 1) / fs->blocksize : 0; 
+    if(1 + inode_blocks + hash_blocks >= blocks){
+        fprintf(stderr, "Disk too small\n"); 
+        return 0; 
+    }
+    // every group gets at least one inode block
+    int ngroups = (blocks - 1 - inode_blocks - hash_blocks) / GROUP_BLOCKS; 
+    ngroups = ngroups < 1 ? 1 : ngroups > MAX_GROUPS ? MAX_GROUPS : ngroups; 
+    ngroups = ngroups > inode_blocks ? inode_blocks : ngroups; 
 
     //update super block
-    disk_read(0, block.data); 
+    memset(block.data, 0, fs->blocksize); 
     block.super.ninodeblocks = inode_blocks;
     block.super.magic = FS_MAGIC; 
     block.super.nblocks = blocks; 
-    disk_write(0, block.data); 
+    block.super.ninodes = inode_blocks * fs->inodes_per_block; 
+    block.super.blocksize = blocksize; 
+    block.super.inodesize = inodesize; 
+    block.super.hashblocks = hash_blocks; 
+    block.super.ngroups = ngroups; 
+    block.super.free_blocks = blocks - 1 - inode_blocks - hash_blocks + 1; 
+    block.super.free_inodes = block.super.ninodes + 1; 
+    disk_write(fs->disk, 0, block.data); 
     
     //clear inodes 
+    memset(block.data, 0, fs->blocksize); 
     for(i=0; i<blocks-1; i++){
-        disk_read(i+1, block.data);  
-        for(j=0; j<INODES_PER_BLOCK; j++){
-            block.inode[j].isvalid = 0;
-            block.inode[j].size = 0; 
-            block.inode[j].indirect = 0; 
-            for(k=0; k<5; k++){
-                block.inode[j].direct[k] = 0; 
-            }
-        }
-        disk_write(i+1, block.data);
+        disk_write(fs->disk, i+1, block.data);
     }
     return 1;
 }
 
-void fs_debug()
+/*
+Totals and free space from the counters the allocators keep, without
+touching the disk. Deleted files the reclaimer has not freed yet are
+pending orphans: their blocks and slots are not counted as free until
+they are reclaimed, and they are not counted as files either.
+*/
+int fs_statfs( struct fs *fs, struct fs_stats *stats )
+{
+    struct fs_group *group; 
+    int g, pending; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    memset(stats, 0, sizeof(*stats)); 
+    stats->blocksize = fs->blocksize; 
+    stats->total_blocks = fs->nblocks - fs->first_data_block; 
+    stats->total_inodes = fs->ninodes; 
+    for(g=0; g<fs->ngroups; g++){
+        group = &fs->groups[g]; 
+        pthread_mutex_lock(&group->lock); 
+        stats->free_blocks += group->free_blocks; 
+        stats->free_inodes += group->free_slots; 
+        pthread_mutex_unlock(&group->lock); 
+    }
+    pthread_mutex_lock(&fs->orphan_lock); 
+    pending = fs->norphans + fs->reclaiming; 
+    pthread_mutex_unlock(&fs->orphan_lock); 
+    stats->files = fs->ninodes - stats->free_inodes - pending; // orphan slots are in neither
+    return 1; 
+}
+
+void fs_debug( struct fs *fs )
 {
     union fs_block block; 
+    struct fs_inode *inode; 
     int i, j, k, x;    
     int first = 1; 
-    disk_read(0,block.data);
+    if(!fs->mounted && !load_geometry(fs, &block)){
+        return; 
+    }
+    disk_read(fs->disk, 0,block.data);
     
-	NBLOCKS = disk_size(); 
-	if( NBLOCKS < block.super.nblocks ){
+	fs->nblocks = disk_size(fs->disk); 
+	if( fs->nblocks < block.super.nblocks ){
 		printf("Not enough disk space to hold this image.\n");
 		return;
 	}
@@ -102,42 +594,62 @@ void fs_debug()
     printf("superblock:\n");
 
     printf("    %d blocks\n",block.super.nblocks);
+    printf("    %d bytes per block\n",fs->blocksize);
+    printf("    %d bytes per inode\n",fs->inodesize);
     printf("    %d inode blocks\n",block.super.ninodeblocks);
     printf("    %d inodes\n",block.super.ninodes);
+    if(block.super.hashblocks){
+        printf("    %d dedup index blocks\n",block.super.hashblocks);
+    }
+    if(block.super.ngroups > 1){
+        printf("    %d block groups\n",block.super.ngroups);
+    }
+    if(block.super.free_blocks > 0 && block.super.free_inodes > 0){
+        printf("    %d free blocks\n",block.super.free_blocks - 1);
+        printf("    %d free inodes\n",block.super.free_inodes - 1);
+    }
 
     int inode_blocks = block.super.ninodeblocks; 
-	int start_inode = 2;
     for (i =0; i<inode_blocks; i++){
-        disk_read(i+1, block.data); 
-        for(j=0; j<INODES_PER_BLOCK; j++){
-            if(block.inode[j].isvalid == 1){
-                if(!MOUNTED){
-                    printf("inode: %d\n", start_inode);   
-					start_inode++;
-                } else{
-                    printf("inode: %d\n", INUMBERS[INODES_PER_BLOCK * i + j]); 
-                } 
-				printf("    size: %d bytes\n", block.inode[j].size); 
+        disk_read(fs->disk, i+1, block.data); 
+        for(j=0; j<fs->inodes_per_block; j++){
+            inode = inode_slot(fs, &block, j); 
+            if(inode->isvalid & INODE_VALID){
+                printf("inode: %d\n", i * fs->inodes_per_block + j + FIRST_INUMBER); 
+				printf("    size: %d bytes\n", inode->size); 
+                if (inode->isvalid & INODE_INLINE){
+                    printf("    inline data\n"); 
+                    continue; 
+                }
+                if (inode->isvalid & INODE_COMPRESSED){
+                    printf("    compressed\n"); 
+                }
+                if (inode->isvalid & INODE_DIRECTORY){
+                    printf("    directory\n"); 
+                }
+                if (inode->isvalid & INODE_ORPHAN){
+                    printf("    deleted, blocks not freed yet\n"); 
+                }
                 for(k=0; k<POINTERS_PER_INODE; k++){
-                    if (block.inode[j].direct[k] != 0){
+                    if (inode->direct[k] != 0){
                         if (first){
                             printf("    direct blocks: "); 
                             first = 0; 
                         }
-                        printf("%d ", block.inode[j].direct[k]); 
+                        printf("%d ", inode->direct[k]); 
                     }
                 }
                 first = 1; 
                 printf("\n");
-                if (block.inode[j].indirect != 0){
-                    printf("    indirect block: %d\n", block.inode[j].indirect);
+                if (inode->indirect != 0){
+                    printf("    indirect block: %d\n", inode->indirect);
                     
                    union fs_block indirect_info; 
                     printf("    indirect data blocks: "); 
                     
-                    disk_read(block.inode[j].indirect, indirect_info.data); 
+                    disk_read(fs->disk, inode->indirect, indirect_info.data); 
                     
-                    for(x = 0; x < POINTERS_PER_BLOCK; x++){
+                    for(x = 0; x < fs->pointers_per_block; x++){
                         if (indirect_info.pointers[x] != 0 ){
                             printf("%d ", indirect_info.pointers[x]); 
                         }
@@ -149,424 +661,4132 @@ void fs_debug()
     }
 }
 
-int fs_mount()
+/*
+Check an image for damage and, if repair is set, fix it. The superblock
+is checked first. Then the inode table is scanned in ranges by the read
+pool, counting every block pointer in a shared array, to find:
+  pointers outside the data area,
+  indirect blocks that are referenced twice or used as data,
+  blocks mapped past the end of a file, and sizes that are impossible,
+  directory entries and named files that do not match each other.
+Data blocks referenced more than once are not an error, since clones
+and dedup share them. Repair drops bad pointers and entries, clamps sizes,
+and clears the dedup hash of every block left unreferenced; the block
+allocation itself is rebuilt from the inodes at mount. A mounted image is
+unmounted for the check and mounted again afterwards, so nothing else may
+use it meanwhile. Returns the number of problems found, or -1 if the
+superblock is unusable or memory runs out.
+*/
+int fs_fsck( struct fs *fs, int repair )
 {
-    union fs_block block; 
-    int i, j;
+    struct fsck_state st; 
+    union fs_block super; 
+    int remount = fs->mounted; 
 
-	// Read superblock
-    disk_read(0, block.data); 
-    if(block.super.magic != FS_MAGIC){
-		printf("Error: No superblock set.\n");
-        return 0; 
+    if(remount){
+        fs_unmount(fs); 
     }
-  
-	NBLOCKS = disk_size(); 
-	if( NBLOCKS < block.super.nblocks ){
-		printf("Not enough disk space to hold this image.\n");
-		return 0;
-	}
-
-	// Set up bitmaps
-    BITMAP = (int *)malloc(sizeof(int)*NBLOCKS); 
-    BLOCK_BITMAP = (int *)malloc(sizeof(int)*NBLOCKS); 
-	NEXT_AVAILABLE = (int *)malloc(sizeof(int)*NBLOCKS);  
-	for( i = 0; i < NBLOCKS; i++ ){
-		NEXT_AVAILABLE[i] = 0;
-		BITMAP[i] = 0;
-		BLOCK_BITMAP[i] = 0;
-	}
 
-    INODE_BITMAP = (int *)malloc(sizeof(int)*NBLOCKS*INODES_PER_BLOCK); 
-    INUMBERS = (int *)malloc(sizeof(int)*NBLOCKS*INODES_PER_BLOCK); 
-	for( i = 0; i < NBLOCKS * INODES_PER_BLOCK; i++ ){
-		INODE_BITMAP[i] = 0;
-		INUMBERS[i] = -1;
-	}
- 
-	BITMAP[0] = 1; //superblock 
-	NEXT_AVAILABLE[0] = 1;
-	NEXT_AVAILABLE[1] = 1; // inode block 1
+    // every exit from here on goes through the remount
+    memset(&st, 0, sizeof(st)); 
+    st.fs = fs; 
+    st.repair = repair; 
+    if(fsck_superblock(&st, &super)){
+        fsck_image(&st, &super); 
+    } else {
+        st.problems = -1; 
+    }
 
-	// assign the bitmaps
-	int start_inode = 2;
-    int inode_blocks = block.super.ninodeblocks; 
-    int k, p; 
-	for(i = 0; i < inode_blocks; i++){
-        for(j=0; j<INODES_PER_BLOCK; j++){
-        	disk_read(i+1, block.data);  
-			if( block.inode[j].isvalid == 1){
-				INUMBERS[i * INODES_PER_BLOCK + j] = start_inode;
-				BLOCK_BITMAP[start_inode] = i+1;
-				INODE_BITMAP[start_inode] = j;
-				NEXT_AVAILABLE[start_inode] = 1;
-				start_inode++;
-				for(k=0; k < POINTERS_PER_INODE; k++){
-					if(block.inode[j].direct[k] != 0){
-						NEXT_AVAILABLE[block.inode[j].direct[k]] = 1;
-					}
-				}
-				if(block.inode[j].indirect != 0 ){
-					NEXT_AVAILABLE[block.inode[j].indirect] = 1;
-					disk_read(block.inode[j].indirect, block.data);
-					for(p = 0; p < POINTERS_PER_BLOCK; p++ ){
-						if( block.pointers[p] != 0 ){
-							NEXT_AVAILABLE[block.pointers[p]] = 1;
-						}
-					}
-				}
-    
-			}
-		}
-	}
-	MOUNTED = 1; 
-    return 1;
+    if(remount){
+        fs_mount(fs); 
+    }
+    return st.problems; 
 }
 
-int fs_create()
-{
-    if(!MOUNTED){
-        fprintf(stderr, "File system not mounted\n"); 
-        return -1; 
-    }
- 
-    int i, x; 
-    union fs_block block; 
-    int free_block = -1; 
-    int inumber = -1; 
+// The checks proper, on an unmounted image whose superblock has loaded.
+static void fsck_image(struct fsck_state *st, union fs_block *super){
+    struct fs *fs = st->fs; 
+    int i, njobs, nfree; 
 
-    NBLOCKS = disk_size(); 
-    
-    for(i=1; i<NBLOCKS; i++){
-        if(BITMAP[i] == 0){
-            free_block = i; 
-            break; 
-        }
+    st->refs = (int *)calloc(fs->nblocks, sizeof(int)); 
+    st->kept = (int *)calloc(fs->nblocks, sizeof(int)); 
+    st->owner = (int *)malloc(sizeof(int) * fs->nblocks); 
+    st->named = (char *)calloc(fs->ninodes, 1); 
+    if(!st->refs || !st->kept || !st->owner || !st->named){
+        fprintf(stderr, "Out of memory\n"); 
+        free(st->refs); free(st->kept); free(st->owner); free(st->named); 
+        st->problems = -1; 
+        return; 
     }
-    if (free_block == -1){
-        fprintf(stderr, "No free blocks\n"); 
-        return 0; 
+    for(i=0; i<fs->nblocks; i++){
+        st->owner[i] = FSCK_NONE; 
     }
-    
-    disk_read(free_block, block.data);
 
-    for(i=1; i<INODES_PER_BLOCK; i++){
-        if(block.inode[i].isvalid == 0){
-            inumber = get_NEXT_AVAILABLE(); 
-            BLOCK_BITMAP[inumber] = free_block;
-            INODE_BITMAP[inumber] = i;
-            INUMBERS[i] = inumber;
+    njobs = (st->ninodeblocks + FSCK_RANGE - 1) / FSCK_RANGE; 
+    st->pass = 1; 
+    if(get_read_pool(fs)){
+        pool_run(fs->read_pool, fsck_range, st, njobs); 
+    } else {
+        for(i=0; i<njobs; i++){
+            fsck_range(st, i); 
+        }
+    }
 
-            block.inode[i].isvalid = 1;
-            block.inode[i].size = 0; 
-            for(x=0; x<5; x++){
-                block.inode[i].direct[x]=0; 
-            }
-            block.inode[i].indirect = 0;  
-            disk_write(free_block, block.data); 
+    // an indirect block belongs to exactly one inode and holds no file data
+    for(i=st->first_data_block; i<fs->nblocks; i++){
+        if(st->owner[i] != FSCK_NONE && st->refs[i] > 1){
+            fsck_problem(st, "block %d is an indirect block but has %d references\n", i, st->refs[i]); 
+        }
+    }
 
-            break; 
+    // counts left by the last unmount; repair marks them unknown for the next one to redo
+    if(super->super.free_blocks > 0 && super->super.free_inodes > 0){
+        for(i=st->first_data_block, nfree=0; i<fs->nblocks; i++){
+            nfree += st->refs[i] == 0; 
+        }
+        if(super->super.free_blocks - 1 != nfree || super->super.free_inodes - 1 != fs->ninodes - st->inodes){
+            fsck_problem(st, "superblock: %d free blocks and %d free inodes recorded, %d and %d found\n", 
+                super->super.free_blocks - 1, super->super.free_inodes - 1, nfree, fs->ninodes - st->inodes); 
+            super->super.free_blocks = 0; 
+            super->super.free_inodes = 0; 
         }
     }
-    if (inumber == -1){
-        fprintf(stderr, "no valid inodes\n"); 
-        return 0; 
+
+    fsck_directory(st, super); 
+    for(i=0; i<fs->ninodes; i++){
+        if(st->named[i] == 1){
+            fsck_problem(st, "slot %d is a named file but no directory entry names it\n", i); 
+        }
     }
-    if(inumber == INODES_PER_BLOCK -1){
-        BITMAP[free_block] = 1; 
+
+    if(st->repair){
+        st->pass = 2; 
+        if(fs->read_pool){
+            pool_run(fs->read_pool, fsck_range, st, njobs); 
+        } else {
+            for(i=0; i<njobs; i++){
+                fsck_range(st, i); 
+            }
+        }
+        fsck_hashes(st); 
+        disk_write(fs->disk, 0, super->data); 
     }
-    return inumber; 
+
+    free(st->refs); 
+    free(st->kept); 
+    free(st->owner); 
+    free(st->named); 
 }
 
-int fs_delete( int inumber )
-{
+static void fsck_problem(struct fsck_state *st, const char *fmt, ...){
+    va_list args; 
+    __sync_fetch_and_add(&st->problems, 1); 
+    va_start(args, fmt); 
+    vprintf(fmt, args); 
+    va_end(args); 
+}
 
-    if(!MOUNTED){
-        fprintf(stderr, "File system not mounted\n"); 
-        return -1; 
+/*
+Load the geometry and check the superblock's counts against it and the
+disk. Fixable fields are corrected in super, which pass 2 writes back.
+*/
+static int fsck_superblock(struct fsck_state *st, union fs_block *super){
+    struct fs *fs = st->fs; 
+    int hashblocks; 
+
+    if(!load_geometry(fs, super)){
+        return 0; 
     }
- 
-    struct fs_inode  curr; 
-	union fs_block block;
-    int i, p;  
-    
-    inode_load(inumber, &curr); 
-    
-    if (curr.isvalid ==0){
-        fprintf(stderr, "Error in deleting inode: does not exist\n"); 
+    if(super->super.magic != FS_MAGIC){
+        printf("superblock: bad magic number %x\n", super->super.magic); 
         return 0; 
     }
-
-	// set inode values and release all NEXT_AVAILABLES
-	for(i=0; i < POINTERS_PER_INODE; i++){
-		if( curr.direct[i] != 0 ){
-			release_inumber(curr.direct[i]);
-        	curr.direct[i] = 0; 
-		}
+    fs->nblocks = disk_size(fs->disk); 
+    if(super->super.nblocks < 2 || super->super.nblocks > fs->nblocks){
+        printf("superblock: %d blocks but the disk has %d\n", super->super.nblocks, fs->nblocks); 
+        return 0; 
     }
-    
-	if( curr.indirect != 0 ){
-		disk_read(curr.indirect, block.data);
-		for(p = 0; p < POINTERS_PER_BLOCK; p++ ){
-			if( block.pointers[p] != 0 ){
-				release_inumber(block.pointers[p]);
-				block.pointers[p] = 0;
-			}
-		}
-		disk_write(curr.indirect, block.data);
-		release_inumber(curr.indirect);
-    	curr.indirect = 0; 
-	}
-    curr.isvalid = 0; 
-    curr.size = 0; 
-    inode_save(inumber, &curr); 
-	release_inumber(inumber);
-    
-    BITMAP[CURR_BLOCK]=0; 
-    INODE_BITMAP[inumber] = 0;
-    BLOCK_BITMAP[inumber] = 0;
-
-    return 1;
-}
+    fs->nblocks = super->super.nblocks; 
+    if(super->super.ninodeblocks < 1 || super->super.ninodeblocks >= fs->nblocks - 1){
+        printf("superblock: %d inode blocks will not fit\n", super->super.ninodeblocks); 
+        return 0; 
+    }
+    st->ninodeblocks = super->super.ninodeblocks; 
+    fs->ninodes = st->ninodeblocks * fs->inodes_per_block; 
 
-int fs_getsize( int inumber )
-{
-    if(!MOUNTED){
-        fprintf(stderr, "File system not mounted\n"); 
-        return -1; 
+    if(super->super.ninodes != fs->ninodes){
+        fsck_problem(st, "superblock: %d inodes, but the table holds %d\n", super->super.ninodes, fs->ninodes); 
+        super->super.ninodes = fs->ninodes; 
     }
-    
-    struct fs_inode curr; 
-    inode_load(inumber, &curr); 
+    hashblocks = (fs->nblocks * (int)sizeof(uint32_t) + fs->blocksize - 1) / fs->blocksize; 
+    if(super->super.hashblocks != 0 && (super->super.hashblocks != hashblocks || 1 + st->ninodeblocks + hashblocks >= fs->nblocks)){
+        fsck_problem(st, "superblock: dedup index of %d blocks, expected %d\n", super->super.hashblocks, hashblocks); 
+        super->super.hashblocks = 0; 
+    }
+    fs->hashblocks = super->super.hashblocks; 
+    st->first_data_block = 1 + st->ninodeblocks + fs->hashblocks; 
+    if(super->super.ngroups < 0 || super->super.ngroups > MAX_GROUPS || super->super.ngroups > st->ninodeblocks){
+        fsck_problem(st, "superblock: %d block groups\n", super->super.ngroups); 
+        super->super.ngroups = 1; 
+    }
+    if(super->super.dirslot < 0 || super->super.dirslot > fs->ninodes){
+        fsck_problem(st, "superblock: directory slot %d is out of range\n", super->super.dirslot - 1); 
+        super->super.dirslot = 0; 
+    }
+    return 1; 
+}
 
-    if (curr.isvalid == 0){
-        fprintf(stderr, "Error: inode does not exist\n"); 
-        return -1;
-    } 
+// pool callback: check (pass 1) or repair (pass 2) FSCK_RANGE inode blocks
+static void fsck_range(void *arg, int index){
+    struct fsck_state *st = (struct fsck_state *)arg; 
+    struct fs *fs = st->fs; 
+    union fs_block block; 
+    struct fs_inode inode; 
+    int i, j, slot, dirty; 
 
-    return curr.size; 
+    for(i = index * FSCK_RANGE; i < (index + 1) * FSCK_RANGE && i < st->ninodeblocks; i++){
+        disk_read(fs->disk, i + 1, block.data); 
+        dirty = 0; 
+        for(j=0; j<fs->inodes_per_block; j++){
+            slot = i * fs->inodes_per_block + j; 
+            memset(&inode, 0, sizeof(inode)); 
+            memcpy(&inode, inode_slot(fs, &block, j), fs->inodesize); 
+            if(!(inode.isvalid & INODE_VALID)){
+                continue; 
+            }
+            if(st->pass == 1){
+                __sync_fetch_and_add(&st->inodes, 1); 
+            }
+            if(fsck_inode(st, slot, &inode)){
+                memcpy(inode_slot(fs, &block, j), &inode, fs->inodesize); 
+                dirty = 1; 
+            }
+        }
+        if(dirty){
+            disk_write(fs->disk, i + 1, block.data); 
+        }
+    }
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
-{
-    if(!MOUNTED){
-        fprintf(stderr, "File system not mounted\n"); 
-        return 0; 
+/*
+Check one valid inode, or in pass 2 repair it. Returns 1 if the inode
+was changed and must be written back.
+*/
+static int fsck_inode(struct fsck_state *st, int slot, struct fs_inode *inode){
+    struct fs *fs = st->fs; 
+    union fs_block indirect; 
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    int max_blocks = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int max_size = max_blocks * fs->blocksize; 
+    int changed = 0, indirect_dirty = 0; 
+    int limit, k, p; 
+
+    if(inode->isvalid & INODE_COMPRESSED){
+        max_size = max_blocks / CLUSTER_BLOCKS * cluster_bytes; 
+    }
+    if(inode->isvalid & INODE_INLINE){
+        max_size = fs->inline_size; 
     }
-    
-	union fs_block block; 
-    struct fs_inode curr; 
-    inode_load(inumber, &curr); 
 
-    if(curr.isvalid == 0){
-        fprintf(stderr, "Inode does not exist\n"); 
-        return 0; 
+    if(st->pass == 1){
+        if(inode->isvalid & ~INODE_FLAGS){
+            fsck_problem(st, "slot %d: unknown flags %x\n", slot, inode->isvalid & ~INODE_FLAGS); 
+        }
+        if((inode->isvalid & INODE_INLINE) && (inode->isvalid & INODE_COMPRESSED)){
+            fsck_problem(st, "slot %d: both inline and compressed\n", slot); 
+        }
+        if(inode->size < 0 || inode->size > max_size){
+            fsck_problem(st, "slot %d: size %d is outside 0..%d\n", slot, inode->size, max_size); 
+        }
+        if(inode->isvalid & INODE_NAMED){
+            st->named[slot] = 1; 
+        }
+    } else {
+        if(inode->isvalid & ~INODE_FLAGS){
+            inode->isvalid &= INODE_FLAGS; 
+            changed = 1; 
+        }
+        if((inode->isvalid & INODE_INLINE) && (inode->isvalid & INODE_COMPRESSED)){
+            inode->isvalid &= ~INODE_COMPRESSED; 
+            max_size = fs->inline_size; 
+            changed = 1; 
+        }
+        if(inode->size < 0 || inode->size > max_size){
+            inode->size = inode->size < 0 ? 0 : max_size; 
+            changed = 1; 
+        }
+        if(st->named[slot] == 1){
+            inode->isvalid &= ~INODE_NAMED; 
+            changed = 1; 
+        }
     }
-    
-    if (offset >= curr.size){
-    	// stops reading from shell
-        return 0; 
+    if(inode->isvalid & INODE_INLINE){
+        return changed; 
     }
-    if(curr.size == 0){
-        fprintf(stderr, "Inode size 0, no data to read\n"); 
-        return 0; 
+
+    /*
+    Compressed file blocks at or past limit hold nothing the size lets
+    anyone read. Plain files may have blocks preallocated past the end by
+    fs_fallocate, which are zeroed before the file grows over them.
+    */
+    if(inode->isvalid & INODE_COMPRESSED){
+        limit = (inode->size + cluster_bytes - 1) / cluster_bytes * CLUSTER_BLOCKS; 
+    } else {
+        limit = POINTERS_PER_INODE + fs->pointers_per_block; 
+    }
+    if(inode->size < 0){
+        limit = 0; 
     }
 
-	if (length <= 0) {
-		printf("length %d invalid\n", length);
-		return 0;
-	}
+    for(k=0; k<POINTERS_PER_INODE; k++){
+        changed |= fsck_pointer(st, slot, k, limit, &inode->direct[k]); 
+    }
+    if(inode->indirect == 0){
+        return changed; 
+    }
 
-	if (offset < 0) {
-		printf("offset %d invalid\n", offset);
-		return 0;
-	}
+    if(st->pass == 1){
+        if(inode->indirect < st->first_data_block || inode->indirect >= fs->nblocks){
+            fsck_problem(st, "slot %d: indirect block %d is out of range\n", slot, inode->indirect); 
+            return changed; 
+        }
+        if(limit <= POINTERS_PER_INODE){
+            fsck_problem(st, "slot %d: indirect block %d is past the end of the file\n", slot, inode->indirect); 
+        }
+        __sync_fetch_and_add(&st->refs[inode->indirect], 1); 
+        // keep the lowest slot as the owner
+        while(1){
+            int seen = st->owner[inode->indirect]; 
+            if(seen <= slot || __sync_bool_compare_and_swap(&st->owner[inode->indirect], seen, slot)){
+                break; 
+            }
+        }
+    } else if(inode->indirect < st->first_data_block || inode->indirect >= fs->nblocks || st->owner[inode->indirect] != slot || limit <= POINTERS_PER_INODE){
+        inode->indirect = 0; 
+        return 1; 
+    } else {
+        st->kept[inode->indirect]++; 
+    }
 
-    int block_pointer = determine_block(inumber, offset); 
-	int offset_bytes = offset % DISK_BLOCK_SIZE;
-    int bytes_read = 0; 
-    int curr_indirect_block;
-
-    while(length > 0){
-		// indirect
-        if(block_pointer >= POINTERS_PER_INODE){
-            disk_read(curr.indirect, block.data); 
-            if( block.pointers[block_pointer - POINTERS_PER_INODE] != 0 ){
-                curr_indirect_block = block.pointers[block_pointer - POINTERS_PER_INODE];
-            } else{
-                return bytes_read; // no more data to read
-            }
-	    	disk_read(curr_indirect_block, block.data);
-        } else { // direct
-            disk_read(curr.direct[block_pointer], block.data); 
-        }
-
-		// copy data 
-        if ( DISK_BLOCK_SIZE - offset_bytes > length ){
-			if( bytes_read + length + offset + offset_bytes > curr.size){
-				memcpy(data, &block.data[offset_bytes], curr.size - offset - offset_bytes);
-            	bytes_read = curr.size - offset - offset_bytes; 
-			} else{
-            	memcpy(data, &block.data[offset_bytes], length);
-            	bytes_read += length; 
-			}
-			length = 0;
-		} else{
-			if( bytes_read + DISK_BLOCK_SIZE + offset + offset_bytes > curr.size){
-				memcpy(data, &block.data[offset_bytes], curr.size - offset - offset_bytes);
-            	bytes_read = curr.size - offset - offset_bytes; 
-				length = 0;
-			}else{
-				memcpy(data, &block.data[offset_bytes], DISK_BLOCK_SIZE);
-            	bytes_read += DISK_BLOCK_SIZE; 
-				length -= DISK_BLOCK_SIZE;
-			}
-    	}
-		
-    	block_pointer++; 
+    disk_read(fs->disk, inode->indirect, indirect.data); 
+    for(p=0; p<fs->pointers_per_block; p++){
+        indirect_dirty |= fsck_pointer(st, slot, POINTERS_PER_INODE + p, limit, &indirect.pointers[p]); 
     }
-    return bytes_read; 
+    if(indirect_dirty){
+        disk_write(fs->disk, inode->indirect, indirect.data); 
+    }
+    return changed; 
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
-{
-	if(!MOUNTED){
-        fprintf(stderr, "File system not mounted\n"); 
+/*
+Pass 1: count a data block pointer and report it if it is out of range or
+past the end of the file. Pass 2: drop it if so, or if the block is an
+indirect block. Returns 1 if the pointer was changed.
+*/
+static int fsck_pointer(struct fsck_state *st, int slot, int index, int limit, int *pointer){
+    int b = *pointer; 
+
+    if(b == 0){
         return 0; 
     }
-    
-	struct fs_inode curr; 
-    union fs_block block; 
-    int x; 
-    inode_load(inumber, &curr); 
-    if(curr.isvalid == 0){
-        fprintf(stderr, "Inode does not exist\n"); 
+    if(st->pass == 1){
+        if(b < st->first_data_block || b >= st->fs->nblocks){
+            fsck_problem(st, "slot %d: file block %d points to block %d, out of range\n", slot, index, b); 
+            return 0; 
+        }
+        if(index >= limit){
+            fsck_problem(st, "slot %d: file block %d is mapped past the end of the file\n", slot, index); 
+        }
+        __sync_fetch_and_add(&st->refs[b], 1); 
         return 0; 
     }
-    
-	int block_pointer = determine_block(inumber, offset); 
-    if(block_pointer == -1){
-        fprintf(stderr, "Offset too large\n"); 
-        return 0; 
-    } 
+    if(b < st->first_data_block || b >= st->fs->nblocks || index >= limit || st->owner[b] != FSCK_NONE){
+        *pointer = 0; 
+        return 1; 
+    }
+    __sync_fetch_and_add(&st->kept[b], 1); 
+    return 0; 
+}
 
-	// user error checking
-	if (length <= 0) {
+/*
+Match directory entries against named inodes: an entry must name a slot
+holding a named file, and only one entry may name it. Bad entries are
+removed when repairing. Runs on one thread between the two passes.
+*/
+static void fsck_directory(struct fsck_state *st, union fs_block *super){
+    struct fs *fs = st->fs; 
+    union fs_block block; 
+    union fs_block header; 
+    struct fs_inode dir; 
+    int dirslot = super->super.dirslot - 1; 
+    int max_blocks = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int i, f, b, slot, dirty; 
+
+    if(dirslot < 0){
+        return; 
+    }
+    disk_read(fs->disk, dirslot / fs->inodes_per_block + 1, block.data); 
+    memset(&dir, 0, sizeof(dir)); 
+    memcpy(&dir, inode_slot(fs, &block, dirslot % fs->inodes_per_block), fs->inodesize); 
+    if(!(dir.isvalid & INODE_VALID) || !(dir.isvalid & INODE_DIRECTORY) || (dir.isvalid & INODE_INLINE)){
+        fsck_problem(st, "superblock: slot %d is not a directory\n", dirslot); 
+        super->super.dirslot = 0; 
+        return; 
+    }
+
+    // the indirect block must be sound before it is followed
+    if(dir.indirect != 0 && (dir.indirect < st->first_data_block || dir.indirect >= fs->nblocks || st->refs[dir.indirect] > 1)){
+        dir.indirect = 0; 
+    }
+    resolve_blocks(fs, &dir, 0, 1, &b); 
+    if(b < st->first_data_block || b >= fs->nblocks){
+        fsck_problem(st, "directory: header block is missing\n"); 
+        return; 
+    }
+    disk_read(fs->disk, b, header.data); 
+    if(header.header.nblocks < 1 || header.header.nblocks > max_blocks){
+        fsck_problem(st, "directory: header claims %d blocks\n", header.header.nblocks); 
+        return; 
+    }
+
+    for(f=1; f<header.header.nblocks; f++){
+        resolve_blocks(fs, &dir, f, 1, &b); 
+        if(b < st->first_data_block || b >= fs->nblocks){
+            fsck_problem(st, "directory: bucket %d is missing\n", f); 
+            continue; 
+        }
+        disk_read(fs->disk, b, block.data); 
+        dirty = 0; 
+        for(i=0; i<block.bucket.count; ){
+            slot = block.bucket.entries[i].slot; 
+            if(slot < 0 || slot >= fs->ninodes || st->named[slot] == 0 || st->named[slot] == 2){
+                fsck_problem(st, "directory: entry %.*s names slot %d, which is %s\n", FS_NAME_MAX, block.bucket.entries[i].name, slot, 
+                    slot >= 0 && slot < fs->ninodes && st->named[slot] == 2 ? "named twice" : "not a named file"); 
+                if(st->repair){
+                    block.bucket.entries[i] = block.bucket.entries[--block.bucket.count]; 
+                    memset(&block.bucket.entries[block.bucket.count], 0, sizeof(struct fs_dirent)); 
+                    dirty = 1; 
+                    continue; 
+                }
+            } else {
+                st->named[slot] = 2; 
+            }
+            i++; 
+        }
+        // a bucket shared with another file is left alone rather than changed under it
+        if(dirty && st->refs[b] == 1){
+            disk_write(fs->disk, b, block.data); 
+        }
+    }
+}
+
+// forget the dedup hash of every block nothing points to any more
+static void fsck_hashes(struct fsck_state *st){
+    struct fs *fs = st->fs; 
+    union fs_block block; 
+    int per_block = fs->blocksize / sizeof(uint32_t); 
+    int i, b, dirty; 
+
+    for(i=0; i<fs->hashblocks; i++){
+        disk_read(fs->disk, st->first_data_block - fs->hashblocks + i, block.data); 
+        dirty = 0; 
+        for(b = i * per_block; b < (i + 1) * per_block && b < fs->nblocks; b++){
+            if(((uint32_t *)block.data)[b - i * per_block] != DEDUP_NONE && (b < st->first_data_block || st->kept[b] == 0)){
+                ((uint32_t *)block.data)[b - i * per_block] = DEDUP_NONE; 
+                dirty = 1; 
+            }
+        }
+        if(dirty){
+            disk_write(fs->disk, st->first_data_block - fs->hashblocks + i, block.data); 
+        }
+    }
+}
+
+int fs_mount( struct fs *fs )
+{
+    union fs_block block; 
+    union fs_block indirect; 
+    struct fs_inode *inode; 
+    int i, j;
+
+    if(fs->mounted){
+        fs_unmount(fs); 
+    }
+
+	// Read superblock
+    if(!load_geometry(fs, &block)){
+        return 0; 
+    }
+    if(block.super.magic != FS_MAGIC){
+		printf("Error: No superblock set.\n");
+        return 0; 
+    }
+  
+	fs->nblocks = disk_size(fs->disk); 
+	if( fs->nblocks < block.super.nblocks ){
+		printf("Not enough disk space to hold this image.\n");
+		return 0;
+	}
+
+    int inode_blocks = block.super.ninodeblocks; 
+    fs->ninodes = inode_blocks * fs->inodes_per_block; 
+    fs->hashblocks = block.super.hashblocks; 
+    int dirslot = block.super.dirslot; 
+    int ngroups = block.super.ngroups; 
+    fs->first_data_block = 1 + inode_blocks + fs->hashblocks; 
+    if(ngroups < 1 || ngroups > inode_blocks || ngroups > fs->nblocks - fs->first_data_block){
+        ngroups = 1; 
+    }
+
+	// block maps live in the groups; blocks before the data area are never free
+	setup_groups(fs, ngroups);
+
+
+	fs->orphans = (int *)malloc(sizeof(int)*fs->ninodes);
+	fs->norphans = 0;
+	if( !fs->orphans ){
+		fprintf(stderr, "Out of memory\n");
+		release_tables(fs);
+		return 0;
+	}
+
+	// mark the slots and blocks in use
+    int k, p, slot, counted = 1; 
+    struct fs_group *group; 
+	for(i = 0; i < inode_blocks; i++){
+        disk_read(fs->disk, i+1, block.data);  
+        for(j=0; j<fs->inodes_per_block; j++){
+            inode = inode_slot(fs, &block, j); 
+			if( inode->isvalid & INODE_VALID){
+				slot = i * fs->inodes_per_block + j;
+				group = &fs->groups[slot_group(fs, slot)];
+				bit_put(group->free_slot_map, slot - group->first_slot, 0);
+				group->free_slots--;
+				if( inode->isvalid & INODE_ORPHAN ){
+					fs->orphans[fs->norphans++] = slot + FIRST_INUMBER; // a delete the last mount did not finish
+				}
+				if( inode->isvalid & INODE_INLINE ){
+					continue; // no blocks to mark
+				}
+				for(k=0; k < POINTERS_PER_INODE; k++){
+					if(inode->direct[k] > 0 && inode->direct[k] < fs->nblocks){
+						counted &= block_ref(block_group(fs, inode->direct[k]), inode->direct[k]);
+					}
+				}
+				if(inode->indirect > 0 && inode->indirect < fs->nblocks){
+					counted &= block_ref(block_group(fs, inode->indirect), inode->indirect);
+					disk_read(fs->disk, inode->indirect, indirect.data);
+					for(p = 0; p < fs->pointers_per_block; p++ ){
+						if( indirect.pointers[p] > 0 && indirect.pointers[p] < fs->nblocks ){
+							counted &= block_ref(block_group(fs, indirect.pointers[p]), indirect.pointers[p]);
+						}
+					}
+				}
+    
+			}
+		}
+	}
+
+	// a shared block whose references could not all be counted would be freed too soon
+	if( !counted ){
+		release_tables(fs);
+		return 0;
+	}
+
+	fill_groups(fs);
+
+	load_hashes(fs);
+
+	fs->dir_inumber = 0;
+	if( dirslot > 0 && dirslot <= fs->ninodes && slot_used(fs, dirslot - 1) ){
+		fs->dir_inumber = dirslot - 1 + FIRST_INUMBER;
+	}
+
+	fs->mounted = 1; 
+	store_counts(fs, 0);
+	start_reclaimer(fs);
+    return 1;
+}
+
+int fs_create( struct fs *fs )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+ 
+    int slot = -1, inumber, g, cpu, i, since; 
+    struct fs_group *group; 
+    struct fs_inode curr; 
+
+    // the lowest free slot in this CPU's group, or failing that the next group with one
+    since = reclaim_generation(fs); 
+    cpu = sched_getcpu(); 
+    g = cpu < 0 ? 0 : cpu % fs->ngroups; 
+    for(i=0; i<fs->ngroups && slot == -1; i++){
+        group = &fs->groups[(g + i) % fs->ngroups]; 
+        pthread_mutex_lock(&group->lock); 
+        slot = bit_find(group->free_slot_map, group->slot_hint, group->end_slot - group->first_slot, 1); 
+        if(slot != -1){
+            bit_put(group->free_slot_map, slot, 0); 
+            group->free_slots--; 
+            group->slot_hint = slot + 1; 
+            slot += group->first_slot; 
+        }
+        pthread_mutex_unlock(&group->lock); 
+    }
+    if(slot == -1 && reclaim_wait(fs, since)){
+        return fs_create(fs); // deleted files held the slots
+    }
+    if(slot == -1){
+        fprintf(stderr, "no valid inodes\n"); 
+        return 0; 
+    }
+
+    inumber = slot + FIRST_INUMBER; 
+
+    // new files start inline and move to blocks when they outgrow the inode
+    memset(&curr, 0, sizeof(curr)); 
+    curr.isvalid = INODE_VALID | INODE_INLINE;
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    inode_save(fs, inumber, &curr); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    return inumber; 
+}
+
+/*
+Create up to n files at once and store their inumbers, lowest first.
+Free slots are taken a group at a time, and each inode block they fall
+in is read and written once however many of them it holds. Returns the
+number created, short only when the inode table fills up.
+*/
+int fs_create_n( struct fs *fs, int *inumbers, int n )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+
+    int got = 0, slot, g, cpu, i, j, inode_block, since; 
+    struct fs_group *group; 
+    struct fs_inode curr; 
+    union fs_block block; 
+    pthread_mutex_t *lock; 
+
+    if(n <= 0){
+        return 0; 
+    }
+
+    cpu = sched_getcpu(); 
+    g = cpu < 0 ? 0 : cpu % fs->ngroups; 
+    do {
+        since = reclaim_generation(fs); 
+        for(i=0; i<fs->ngroups && got < n; i++){
+            group = &fs->groups[(g + i) % fs->ngroups]; 
+            pthread_mutex_lock(&group->lock); 
+            while(got < n){
+                slot = bit_find(group->free_slot_map, group->slot_hint, group->end_slot - group->first_slot, 1); 
+                if(slot == -1){
+                    break; 
+                }
+                bit_put(group->free_slot_map, slot, 0); 
+                group->free_slots--; 
+                group->slot_hint = slot + 1; 
+                inumbers[got++] = slot + group->first_slot; 
+            }
+            pthread_mutex_unlock(&group->lock); 
+        }
+    } while(got < n && reclaim_wait(fs, since)); 
+    if(got == 0){
+        fprintf(stderr, "no valid inodes\n"); 
+        return 0; 
+    }
+    qsort(inumbers, got, sizeof(int), compare_ints); 
+
+    // nobody else knows these inumbers yet, so only the inode blocks need locking
+    memset(&curr, 0, sizeof(curr)); 
+    curr.isvalid = INODE_VALID | INODE_INLINE;
+    for(i=0; i<got; i=j){
+        inode_block = inumbers[i] / fs->inodes_per_block + 1; 
+        lock = &fs->itable_locks[inode_block % ITABLE_LOCKS]; 
+        pthread_mutex_lock(lock); 
+        disk_read(fs->disk, inode_block, block.data); 
+        for(j=i; j<got && inumbers[j] / fs->inodes_per_block + 1 == inode_block; j++){
+            memcpy(inode_slot(fs, &block, inumbers[j] % fs->inodes_per_block), &curr, fs->inodesize); 
+            inumbers[j] += FIRST_INUMBER; 
+        }
+        disk_write(fs->disk, inode_block, block.data); 
+        pthread_mutex_unlock(lock); 
+    }
+    return got; 
+}
+
+int fs_delete( struct fs *fs, int inumber )
+{
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+
+    int result; 
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    result = inode_delete(fs, inumber); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+/*
+Only mark the inode an orphan and queue it; the reclaimer frees its
+blocks, indirect block and slot in the background.
+*/
+static int inode_delete(struct fs *fs, int inumber)
+{
+    struct fs_inode  curr; 
+    
+    if (!inode_load(fs, inumber, &curr) || curr.isvalid ==0){
+        fprintf(stderr, "Error in deleting inode: does not exist\n"); 
+        return 0; 
+    }
+    if (curr.isvalid & (INODE_NAMED | INODE_DIRECTORY)){
+        fprintf(stderr, "Inode %d has a name; remove it with unlink\n", inumber); 
+        return 0; 
+    }
+
+    curr.isvalid |= INODE_ORPHAN; 
+    inode_save(fs, inumber, &curr); 
+
+    pthread_mutex_lock(&fs->orphan_lock); 
+    fs->orphans[fs->norphans++] = inumber; 
+    pthread_cond_broadcast(&fs->orphan_cond); 
+    pthread_mutex_unlock(&fs->orphan_lock); 
+    if(!fs->reclaimer_started){
+        reclaim_wait(fs, 0); 
+    }
+    return 1;
+}
+
+/*
+Delete a list of files at once rather than through the reclaimer.
+Entries that are not deletable files are skipped. Returns the number
+deleted.
+*/
+int fs_delete_n( struct fs *fs, const int *inumbers, int n )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+    if(n <= 0){
+        return 0; 
+    }
+
+    int *sorted = (int *)malloc(sizeof(int)*n); 
+    int i, k, slot, deleted; 
+
+    if(!sorted){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+    memcpy(sorted, inumbers, sizeof(int)*n); 
+    qsort(sorted, n, sizeof(int), compare_ints); 
+
+    // the batch keeps only the deletable inumbers, once each
+    for(i=0, k=0; i<n; i++){
+        slot = sorted[i] - FIRST_INUMBER; 
+        if(slot >= 0 && slot < fs->ninodes && (k == 0 || sorted[k-1] != sorted[i])){
+            sorted[k++] = sorted[i]; 
+        }
+    }
+
+    deleted = free_inodes(fs, sorted, k, 0); 
+    free(sorted); 
+    return deleted; 
+}
+
+/*
+Wait until the reclaimer has freed every file deleted so far, for
+callers that need the space back or count blocks and disk I/O.
+*/
+int fs_sync( struct fs *fs )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+    reclaim_wait(fs, 0); 
+    return 1; 
+}
+
+/*
+Free the inodes in sorted[0..n), distinct and in range, that are files
+or, with orphans set, that are orphans; the rest are set to 0. The
+inodes are cleared an inode block at a time, each block read and written
+once, under the locks of all the inodes in it taken in stripe order;
+orphans need none. Their data blocks are then released together, sorted,
+so each group is locked once and adjacent blocks go back to the extents
+as one run. Returns the number freed.
+*/
+static int free_inodes(struct fs *fs, int *sorted, int n, int orphans)
+{
+    int *freed = 0, *more; 
+    int nfreed = 0, capacity = 0, deleted = 0, block_start; 
+    int i, j, k, p, inode_block, slot, wanted; 
+    uint64_t stripes[INODE_LOCKS / 64]; 
+    struct fs_inode *inode; 
+    struct fs_group *group; 
+    union fs_block block, indirect; 
+    pthread_mutex_t *lock; 
+
+    for(i=0; i<n; i=j){
+        slot = sorted[i] - FIRST_INUMBER; 
+        inode_block = slot / fs->inodes_per_block + 1; 
+        j = i; 
+        while(j < n && (sorted[j] - FIRST_INUMBER) / fs->inodes_per_block + 1 == inode_block){
+            j++; 
+        }
+        block_start = nfreed; 
+
+        memset(stripes, 0, sizeof(stripes)); 
+        for(k=i; k<j && !orphans; k++){
+            bit_put(stripes, sorted[k] % INODE_LOCKS, 1); 
+        }
+        for(k=0; k<INODE_LOCKS; k++){
+            if(bit_get(stripes, k)){
+                pthread_rwlock_wrlock(&fs->inode_locks[k]); 
+            }
+        }
+
+        // what to free is read first, so the inode block is only locked to clear them
+        disk_read(fs->disk, inode_block, block.data); 
+        for(k=i; k<j; k++){
+            slot = sorted[k] - FIRST_INUMBER; 
+            inode = inode_slot(fs, &block, slot % fs->inodes_per_block); 
+            if(orphans){
+                wanted = (inode->isvalid & INODE_ORPHAN) != 0; 
+            } else {
+                wanted = (inode->isvalid & INODE_VALID) && !(inode->isvalid & (INODE_NAMED | INODE_DIRECTORY | INODE_ORPHAN)); 
+            }
+            if(!wanted || !slot_used(fs, slot)){
+                sorted[k] = 0; 
+                continue; 
+            }
+            // room for every pointer the inode can have; without it the batch ends here
+            if(nfreed + POINTERS_PER_INODE + fs->pointers_per_block + 1 > capacity){
+                more = (int *)realloc(freed, sizeof(int)*(2 * capacity + POINTERS_PER_INODE + fs->pointers_per_block + 1)); 
+                if(!more){
+                    fprintf(stderr, "Out of memory\n"); 
+                    nfreed = block_start; 
+                    memset(&sorted[i], 0, sizeof(int)*(n - i)); 
+                    j = n; 
+                    break; 
+                }
+                freed = more; 
+                capacity = 2 * capacity + POINTERS_PER_INODE + fs->pointers_per_block + 1; 
+            }
+            for(p=0; p<POINTERS_PER_INODE && !(inode->isvalid & INODE_INLINE); p++){
+                if(inode->direct[p] != 0){
+                    freed[nfreed++] = inode->direct[p]; 
+                }
+            }
+            if(!(inode->isvalid & INODE_INLINE) && inode->indirect != 0){
+                disk_read(fs->disk, inode->indirect, indirect.data); 
+                for(p=0; p<fs->pointers_per_block; p++){
+                    if(indirect.pointers[p] != 0){
+                        freed[nfreed++] = indirect.pointers[p]; 
+                    }
+                }
+                freed[nfreed++] = inode->indirect; 
+            }
+        }
+
+        lock = &fs->itable_locks[inode_block % ITABLE_LOCKS]; 
+        pthread_mutex_lock(lock); 
+        disk_read(fs->disk, inode_block, block.data); 
+        for(k=i; k<j; k++){
+            if(sorted[k] != 0){
+                memset(inode_slot(fs, &block, (sorted[k] - FIRST_INUMBER) % fs->inodes_per_block), 0, fs->inodesize); 
+                deleted++; 
+            }
+        }
+        disk_write(fs->disk, inode_block, block.data); 
+        pthread_mutex_unlock(lock); 
+
+        for(k=INODE_LOCKS-1; k>=0; k--){
+            if(bit_get(stripes, k)){
+                pthread_rwlock_unlock(&fs->inode_locks[k]); 
+            }
+        }
+    }
+
+    /*
+    The slots stay taken until the blocks and windows are back, so a new
+    file cannot reuse an inumber whose window is still being dropped.
+    */
+    release_blocks(fs, freed, nfreed); 
+    for(i=0; i<n; i++){
+        if(sorted[i] == 0){
+            continue; 
+        }
+        drop_window(fs, sorted[i]); 
+        slot = sorted[i] - FIRST_INUMBER; 
+        group = &fs->groups[slot_group(fs, slot)]; 
+        pthread_mutex_lock(&group->lock); 
+        bit_put(group->free_slot_map, slot - group->first_slot, 1); 
+        group->free_slots++; 
+        if(slot - group->first_slot < group->slot_hint){
+            group->slot_hint = slot - group->first_slot; 
+        }
+        pthread_mutex_unlock(&group->lock); 
+    }
+
+    free(freed); 
+    return deleted; 
+}
+
+/*
+The reclaimer: take up to RECLAIM_BATCH orphans off the list and free
+them together, until unmount asks it to stop and the list is empty.
+*/
+static void * reclaim_thread(void *arg){
+    struct fs *fs = (struct fs *)arg; 
+    int batch[RECLAIM_BATCH]; 
+    int n; 
+
+    pthread_mutex_lock(&fs->orphan_lock); 
+    for(;;){
+        while(fs->norphans == 0 && !fs->reclaim_stop){
+            pthread_cond_wait(&fs->orphan_cond, &fs->orphan_lock); 
+        }
+        if(fs->norphans == 0){
+            break; 
+        }
+        n = fs->norphans < RECLAIM_BATCH ? fs->norphans : RECLAIM_BATCH; 
+        fs->norphans -= n; 
+        memcpy(batch, &fs->orphans[fs->norphans], sizeof(int)*n); 
+        fs->reclaiming += n; 
+        pthread_mutex_unlock(&fs->orphan_lock); 
+
+        qsort(batch, n, sizeof(int), compare_ints); 
+        free_inodes(fs, batch, n, 1); 
+
+        pthread_mutex_lock(&fs->orphan_lock); 
+        fs->reclaiming -= n; 
+        __sync_fetch_and_add(&fs->reclaimed, 1); 
+        pthread_cond_broadcast(&fs->orphan_cond); 
+    }
+    pthread_mutex_unlock(&fs->orphan_lock); 
+    return 0; 
+}
+
+// without a thread, the orphans are freed right away by whoever queued them
+static void start_reclaimer(struct fs *fs){
+    fs->reclaim_stop = 0; 
+    fs->reclaiming = 0; 
+    fs->reclaimer_started = pthread_create(&fs->reclaimer, 0, reclaim_thread, fs) == 0; 
+    if(!fs->reclaimer_started){
+        reclaim_wait(fs, 0); 
+    }
+}
+
+static void stop_reclaimer(struct fs *fs){
+    if(!fs->reclaimer_started){
+        return; 
+    }
+    pthread_mutex_lock(&fs->orphan_lock); 
+    fs->reclaim_stop = 1; 
+    pthread_cond_broadcast(&fs->orphan_cond); 
+    pthread_mutex_unlock(&fs->orphan_lock); 
+    pthread_join(fs->reclaimer, 0); 
+    fs->reclaimer_started = 0; 
+}
+
+// a snapshot to take before looking for free space, for reclaim_wait
+static int reclaim_generation(struct fs *fs){
+    return __sync_fetch_and_add(&fs->reclaimed, 0); 
+}
+
+/*
+Wait until every orphan queued so far is freed, for an allocation that
+came up empty, taking batches off the list itself rather than waiting
+for the reclaimer to wake up. Returns 1 if anything was freed since the
+generation the caller saw before it looked, so the caller should retry.
+The caller must hold no lock but its inode lock.
+*/
+static int reclaim_wait(struct fs *fs, int since){
+    int batch[RECLAIM_BATCH]; 
+    int n; 
+
+    pthread_mutex_lock(&fs->orphan_lock); 
+    while(fs->norphans > 0 || fs->reclaiming > 0){
+        if(fs->norphans == 0){
+            pthread_cond_wait(&fs->orphan_cond, &fs->orphan_lock); 
+            continue; 
+        }
+        n = fs->norphans < RECLAIM_BATCH ? fs->norphans : RECLAIM_BATCH; 
+        fs->norphans -= n; 
+        memcpy(batch, &fs->orphans[fs->norphans], sizeof(int)*n); 
+        fs->reclaiming += n; 
+        pthread_mutex_unlock(&fs->orphan_lock); 
+
+        qsort(batch, n, sizeof(int), compare_ints); 
+        free_inodes(fs, batch, n, 1); 
+
+        pthread_mutex_lock(&fs->orphan_lock); 
+        fs->reclaiming -= n; 
+        __sync_fetch_and_add(&fs->reclaimed, 1); 
+        pthread_cond_broadcast(&fs->orphan_cond); 
+    }
+    pthread_mutex_unlock(&fs->orphan_lock); 
+    return reclaim_generation(fs) != since; 
+}
+
+int fs_getsize( struct fs *fs, int inumber )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+    
+    struct fs_inode curr; 
+    int found; 
+
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    found = inode_load(fs, inumber, &curr); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    if (!found || curr.isvalid == 0){
+        fprintf(stderr, "Error: inode does not exist\n"); 
+        return -1;
+    } 
+
+    return curr.size; 
+}
+
+int fs_read( struct fs *fs, int inumber, char *data, int length, int offset )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    result = inode_read(fs, inumber, data, length, offset); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+static int inode_read(struct fs *fs, int inumber, char *data, int length, int offset)
+{
+    struct fs_inode curr; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    
+    if (offset >= curr.size){
+    	// stops reading from shell
+        return 0; 
+    }
+    if(curr.size == 0){
+        fprintf(stderr, "Inode size 0, no data to read\n"); 
+        return 0; 
+    }
+
+	if (length <= 0) {
+		printf("length %d invalid\n", length);
+		return 0;
+	}
+
+	if (offset < 0) {
+		printf("offset %d invalid\n", offset);
+		return 0;
+	}
+
+    if(length > curr.size - offset){
+        length = curr.size - offset; 
+    }
+
+    if(curr.isvalid & INODE_INLINE){
+        memcpy(data, &curr.data[offset], length); 
+        return length; 
+    }
+    if(curr.isvalid & INODE_COMPRESSED){
+        return read_clusters(fs, &curr, data, length, offset); 
+    }
+
+    // resolve every block of the range up front so the reads can be issued together
+    struct read_request req; 
+    int first = offset / fs->blocksize; 
+    int nblocks = (offset + length - 1) / fs->blocksize - first + 1; 
+    int i; 
+
+    req.fs = fs; 
+    req.first = first; 
+    req.data = data; 
+    req.offset = offset; 
+    req.length = length; 
+    req.blocks = (int *)malloc(sizeof(int)*nblocks); 
+    if(!req.blocks){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+    resolve_blocks(fs, &curr, first, nblocks, req.blocks); 
+
+    if(nblocks >= PARALLEL_READ_BLOCKS && get_read_pool(fs)){
+        pool_run(fs->read_pool, read_one_block, &req, nblocks); 
+    } else {
+        for(i=0; i<nblocks; i++){
+            read_one_block(&req, i); 
+        }
+    }
+
+    free(req.blocks); 
+    return length; 
+}
+
+/*
+Fill blocks[0..nblocks) with the disk blocks holding file blocks
+first..first+nblocks-1, reading the indirect block at most once.
+Unmapped blocks come back as 0.
+*/
+static void resolve_blocks(struct fs *fs, struct fs_inode *inode, int first, int nblocks, int *blocks){
+    union fs_block indirect; 
+    int have_indirect = 0; 
+    int i, b; 
+
+    for(i=0; i<nblocks; i++){
+        b = first + i; 
+        if(b < POINTERS_PER_INODE){
+            blocks[i] = inode->direct[b]; 
+        } else if(inode->indirect == 0){
+            blocks[i] = 0; 
+        } else {
+            if(!have_indirect){
+                disk_read(fs->disk, inode->indirect, indirect.data); 
+                have_indirect = 1; 
+            }
+            blocks[i] = indirect.pointers[b - POINTERS_PER_INODE]; 
+        }
+    }
+}
+
+// copy the part of file block req->first+index that falls inside the request
+static void read_one_block(void *arg, int index){
+    struct read_request *req = (struct read_request *)arg; 
+    union fs_block block; 
+    int start = (req->first + index) * req->fs->blocksize; 
+    int from = start > req->offset ? start : req->offset; 
+    int to = start + req->fs->blocksize; 
+
+    if(to > req->offset + req->length){
+        to = req->offset + req->length; 
+    }
+    if(req->blocks[index] == 0){
+        memset(req->data + (from - req->offset), 0, to - from); 
+        return; 
+    }
+    disk_read(req->fs->disk, req->blocks[index], block.data); 
+    memcpy(req->data + (from - req->offset), &block.data[from - start], to - from); 
+}
+
+// the pool is only started once a read is large enough to need it
+static struct pool * get_read_pool(struct fs *fs){
+    pthread_mutex_lock(&fs->read_pool_lock); 
+    if(!fs->read_pool){
+        fs->read_pool = pool_create(READ_WORKERS); 
+    }
+    pthread_mutex_unlock(&fs->read_pool_lock); 
+    return fs->read_pool; 
+}
+
+int fs_write( struct fs *fs, int inumber, const char *data, int length, int offset )
+{
+	if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    result = inode_write(fs, inumber, data, length, offset); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+static int inode_write(struct fs *fs, int inumber, const char *data, int length, int offset)
+{
+	struct fs_inode curr; 
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    return write_contents(fs, inumber, &curr, data, length, offset); 
+}
+
+// the rest of inode_write, for an inode that is already loaded
+static int write_contents(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset)
+{
+    struct fs_inode curr = *inode; 
+
+    if(determine_block(fs, offset) == -1){
+        fprintf(stderr, "Offset too large\n"); 
+        return 0; 
+    } 
+
+	// user error checking
+	if (length <= 0) {
 		printf("length %d invalid\n", length);
 		return 0;
 	}
 
-	if (offset < 0) {
-		printf("offset %d invalid\n", offset);
+	if (offset < 0) {
+		printf("offset %d invalid\n", offset);
+		return 0;
+	}
+
+    if(curr.isvalid & INODE_INLINE){
+        if(offset + length <= fs->inline_size){
+            if(offset > curr.size){
+                memset(&curr.data[curr.size], 0, offset - curr.size); 
+            }
+            memcpy(&curr.data[offset], data, length); 
+            if(offset + length > curr.size){
+                curr.size = offset + length; 
+            }
+            inode_save(fs, inumber, &curr); 
+            return length; 
+        }
+
+        /*
+        Outgrown: move the contents into blocks. The old bytes and the part
+        of this write that lands in the first block go out together, so the
+        first block is written only once.
+        */
+        char head[DISK_MAX_BLOCK_SIZE]; 
+        int head_length = curr.size; 
+        int merged = 0; 
+        memcpy(head, curr.data, curr.size); 
+        if(offset < fs->blocksize){
+            merged = fs->blocksize - offset < length ? fs->blocksize - offset : length; 
+            if(offset > curr.size){
+                memset(&head[curr.size], 0, offset - curr.size); 
+            }
+            memcpy(&head[offset], data, merged); 
+            if(offset + merged > head_length){
+                head_length = offset + merged; 
+            }
+        }
+        memset(curr.data, 0, sizeof(curr.data)); 
+        curr.isvalid &= ~INODE_INLINE; 
+        curr.size = 0; 
+        if(head_length > 0 && write_blocks(fs, inumber, &curr, head, head_length, 0) != head_length){
+            // no room for the first block: stay inline, as before the write
+            release_tail(fs, &curr, 0); 
+            inode_save(fs, inumber, inode); 
+            return 0; 
+        }
+        if(merged == length){
+            return length; 
+        }
+        data += merged; 
+        offset += merged; 
+        length -= merged; 
+        return merged + write_blocks(fs, inumber, &curr, data, length, offset); 
+    }
+
+    if(curr.isvalid & INODE_COMPRESSED){
+        return write_clusters(fs, inumber, &curr, data, length, offset); 
+    }
+    return write_blocks(fs, inumber, &curr, data, length, offset); 
+}
+
+/*
+Write into a block-mapped inode and save it. Only the blocks the range
+touches are mapped; anything skipped over stays a hole that reads back as
+zeros. Blocks that are already mapped are overwritten in place, and the
+size only ever grows.
+*/
+static int write_blocks(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset)
+{
+    struct fs_inode curr = *inode; 
+    int bytes_written; 
+
+    // mapped blocks past the end may hold stale bytes; the gap must read as zeros
+    if(offset > curr.size && !zero_range(fs, inumber, &curr, curr.size, offset)){
+        return 0; 
+    }
+
+    bytes_written = put_blocks(fs, inumber, &curr, data, length, offset, 1); 
+    if(bytes_written > 0 && offset + bytes_written > curr.size){
+        curr.size = bytes_written + offset;
+    }
+    inode_save(fs, inumber, &curr);
+    *inode = curr; 
+    return bytes_written;
+}
+
+/*
+Copy data, or zeros if data is null, into file bytes [offset,offset+length)
+of inode. Unmapped blocks are allocated when fill_holes is set and skipped
+otherwise. A block shared with a clone is copied before it is changed.
+Only full blocks skip the read of the old contents. The inode's pointers
+are updated but the inode is not saved. Returns the bytes covered, which
+is short only when the disk fills up.
+*/
+static int put_blocks(struct fs *fs, int inumber, struct fs_inode *curr, const char *data, int length, int offset, int fill_holes)
+{
+    union fs_block block; 
+    union fs_block indirect; 
+    int have_indirect = 0; 
+    int indirect_dirty = 0; 
+	int block_pointer = offset / fs->blocksize; 
+    int offset_bytes = offset % fs->blocksize;
+    int done = 0;
+    int chunk, fresh, shared, blocknum, match, *pointer; 
+    uint32_t hash = DEDUP_NONE; 
+    int goal = 0; 
+
+    // new blocks go right after the block before them in the file, or near the inode
+    if(block_pointer > 0 && block_pointer <= POINTERS_PER_INODE){
+        goal = curr->direct[block_pointer - 1]; 
+    } else if(block_pointer > POINTERS_PER_INODE && curr->indirect != 0 && block_pointer < POINTERS_PER_INODE + fs->pointers_per_block){
+        disk_read(fs->disk, curr->indirect, indirect.data); 
+        have_indirect = 1; 
+        goal = indirect.pointers[block_pointer - 1 - POINTERS_PER_INODE]; 
+    }
+    goal = goal ? goal + 1 : inode_goal(fs, inumber); 
+
+    while(length > 0 && block_pointer < POINTERS_PER_INODE + fs->pointers_per_block){
+        chunk = fs->blocksize - offset_bytes < length ? fs->blocksize - offset_bytes : length; 
+
+        if(block_pointer < POINTERS_PER_INODE){ // direct
+            pointer = &curr->direct[block_pointer]; 
+        } else { // indirect, brought in by the first block past the direct pointers
+            if(curr->indirect == 0){
+                if(!fill_holes){
+                    done += length; // nothing is mapped from here on
+                    break; 
+                }
+                curr->indirect = get_NEXT_AVAILABLE(fs, goal, inumber);
+                if(curr->indirect == -1){
+                    curr->indirect = 0; 
+                    break; // out of space
+                }
+                goal = curr->indirect + 1; 
+                memset(indirect.data, 0, fs->blocksize); 
+                have_indirect = 1; 
+                indirect_dirty = 1; 
+            } else if(!have_indirect){
+                disk_read(fs->disk, curr->indirect, indirect.data); 
+                have_indirect = 1; 
+            }
+            pointer = &indirect.pointers[block_pointer - POINTERS_PER_INODE]; 
+        }
+
+        // a full block that is already on disk somewhere is shared instead of written
+        if(fs->hashblocks && data && chunk == fs->blocksize){
+            hash = hash_block(data + done, chunk); 
+            match = dedup_lookup(fs, hash, data + done); 
+            if(match){
+                if(*pointer != 0){
+                    release_inumber(fs, *pointer); 
+                }
+                *pointer = match; 
+                if(block_pointer >= POINTERS_PER_INODE){
+                    indirect_dirty = 1; 
+                }
+                done += chunk; 
+                length -= chunk; 
+                block_pointer++;
+                continue; 
+            }
+        }
+
+        fresh = 0; 
+        shared = 0; 
+        if(*pointer == 0 && !fill_holes){
+            blocknum = 0; 
+        } else if(*pointer == 0){
+            fresh = 1; 
+        } else if(!own_block(fs, *pointer)){
+            shared = *pointer; 
+        }
+
+        if(fresh || shared){
+            blocknum = get_NEXT_AVAILABLE(fs, goal, inumber); 
+            if(blocknum == -1){
+                break; // out of space
+            }
+            *pointer = blocknum; 
+            if(block_pointer >= POINTERS_PER_INODE){
+                indirect_dirty = 1; 
+            }
+        }
+        blocknum = *pointer; 
+        if(blocknum != 0){
+            goal = blocknum + 1; 
+        }
+
+        if(blocknum != 0){
+            // only a partial overwrite of a mapped block needs its old contents
+            if(chunk < fs->blocksize){
+                if(fresh){
+                    memset(block.data, 0, fs->blocksize); 
+                } else {
+                    disk_read(fs->disk, shared ? shared : blocknum, block.data); 
+                }
+            }
+            if(data){
+                memcpy(&block.data[offset_bytes], data + done, chunk);
+            } else {
+                memset(&block.data[offset_bytes], 0, chunk); 
+            }
+            disk_write(fs->disk, blocknum, block.data); 
+            if(shared){
+                release_inumber(fs, shared); // this inode now has its own copy
+            }
+            if(fs->hashblocks && data && chunk == fs->blocksize){
+                dedup_insert(fs, blocknum, hash); 
+            }
+        }
+
+        done += chunk; 
+        length -= chunk; 
+        offset_bytes = 0; 
+        block_pointer++;
+    }   
+
+    if(indirect_dirty){
+        disk_write(fs->disk, curr->indirect, indirect.data); 
+    }
+    return done;
+}
+
+/*
+Scatter/gather versions of fs_read and fs_write: iov[0..iovcnt) is laid
+over consecutive file bytes starting at offset, as with preadv and
+pwritev. The inode is loaded, its block map walked and the inode saved
+once for the whole list, and each run of consecutive disk blocks moves
+in a single vectored disk call straight to or from the buffers.
+*/
+int fs_readv( struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    result = inode_readv(fs, inumber, iov, iovcnt, offset); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+int fs_writev( struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset )
+{
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    result = inode_writev(fs, inumber, iov, iovcnt, offset); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+static int inode_readv(struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    struct fs_inode curr; 
+    struct iov_cursor cursor = { iov, iovcnt, 0, 0 }; 
+    int length = iov_total(iov, iovcnt); 
+    char *base; 
+    int done, n; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    if(length <= 0){
+        printf("length %d invalid\n", length);
+        return 0;
+    }
+    if(offset < 0){
+        printf("offset %d invalid\n", offset);
+        return 0;
+    }
+    if(offset >= curr.size){
+        return 0; 
+    }
+    if(length > curr.size - offset){
+        length = curr.size - offset; 
+    }
+
+    if(curr.isvalid & INODE_INLINE){
+        cursor_copy(&cursor, 0, &curr.data[offset], length); 
+        return length; 
+    }
+    if(curr.isvalid & INODE_COMPRESSED){
+        // clusters are decompressed anyway, so each buffer is simply read in turn
+        for(done=0; done < length; done += n){
+            n = cursor_next(&cursor, length - done, &base); 
+            if(read_clusters(fs, &curr, base, n, offset + done) != n){
+                return done; 
+            }
+        }
+        return length; 
+    }
+
+    union fs_block spare; 
+    int first = offset / fs->blocksize; 
+    int nblocks = (offset + length - 1) / fs->blocksize - first + 1; 
+    int *blocks = (int *)malloc(sizeof(int)*nblocks); 
+    struct iovec *vec = (struct iovec *)malloc(sizeof(struct iovec)*(iovcnt + nblocks + 2)); 
+    int nvec = 0, run_start = 0, run_count = 0; 
+    int i, start, from, to; 
+
+    if(!blocks || !vec){
+        fprintf(stderr, "Out of memory\n"); 
+        free(blocks); 
+        free(vec); 
+        return 0; 
+    }
+    resolve_blocks(fs, &curr, first, nblocks, blocks); 
+
+    for(i=0; i<=nblocks; i++){
+        // a hole, a jump on disk or the end sends the run so far
+        if(run_count > 0 && (i == nblocks || blocks[i] != run_start + run_count)){
+            disk_readv(fs->disk, run_start, run_count, vec, nvec); 
+            nvec = 0; 
+            run_count = 0; 
+        }
+        if(i == nblocks){
+            break; 
+        }
+
+        start = (first + i) * fs->blocksize; 
+        from = start > offset ? start : offset; 
+        to = start + fs->blocksize < offset + length ? start + fs->blocksize : offset + length; 
+        if(blocks[i] == 0){
+            cursor_copy(&cursor, 0, 0, to - from); 
+            continue; 
+        }
+
+        if(run_count == 0){
+            run_start = blocks[i]; 
+        }
+        if(from > start){
+            vec[nvec].iov_base = spare.data; 
+            vec[nvec++].iov_len = from - start; 
+        }
+        cursor_slices(&cursor, vec, &nvec, to - from); 
+        if(to < start + fs->blocksize){
+            vec[nvec].iov_base = &spare.data[to - start]; 
+            vec[nvec++].iov_len = start + fs->blocksize - to; 
+        }
+        run_count++; 
+    }
+
+    free(blocks); 
+    free(vec); 
+    return length; 
+}
+
+static int inode_writev(struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset)
+{
+    struct fs_inode curr; 
+    struct iov_cursor cursor = { iov, iovcnt, 0, 0 }; 
+    int length = iov_total(iov, iovcnt); 
+    char *data; 
+    int result; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    if(determine_block(fs, offset) == -1){
+        fprintf(stderr, "Offset too large\n"); 
+        return 0; 
+    } 
+    if(length <= 0){
+        printf("length %d invalid\n", length);
+        return 0;
+    }
+    if(offset < 0){
+        printf("offset %d invalid\n", offset);
+        return 0;
+    }
+
+    // an inline write fits in the inode, and compressed data is copied to compress it anyway
+    if(((curr.isvalid & INODE_INLINE) && offset + length <= fs->inline_size) || (curr.isvalid & INODE_COMPRESSED)){
+        data = (char *)malloc(length); 
+        if(!data){
+            fprintf(stderr, "Out of memory\n"); 
+            return 0; 
+        }
+        cursor_copy(&cursor, data, 0, length); 
+        result = write_contents(fs, inumber, &curr, data, length, offset); 
+        free(data); 
+        return result; 
+    }
+    if((curr.isvalid & INODE_INLINE) && !inline_to_blocks(fs, inumber, &curr)){
+        return 0; 
+    }
+    return write_vector(fs, inumber, &curr, &cursor, length, offset); 
+}
+
+/*
+write_blocks for the bytes under cursor. Blocks are allocated, copied on
+write and deduplicated as put_blocks does them, but a block only passes
+through a buffer here when part of it must be read first or its contents
+hashed; the rest are written from the caller's buffers, a run of
+consecutive disk blocks at a time.
+*/
+static int write_vector(struct fs *fs, int inumber, struct fs_inode *inode, struct iov_cursor *cursor, int length, int offset)
+{
+    struct fs_inode curr = *inode; 
+    union fs_block indirect, head, tail, block; 
+    int have_indirect = 0; 
+    int indirect_dirty = 0; 
+    int end = offset + length; 
+    int limit = (POINTERS_PER_INODE + fs->pointers_per_block) * fs->blocksize; 
+    int first, nblocks, nvec = 0, run_start = 0, run_count = 0; 
+    int i, start, from, to, chunk, fresh, shared, blocknum, match, *pointer; 
+    int done = 0; 
+    int goal = 0; 
+    uint32_t hash; 
+    char *buffer; 
+    struct iovec *vec; 
+
+    // mapped blocks past the end may hold stale bytes; the gap must read as zeros
+    if(offset > curr.size && !zero_range(fs, inumber, &curr, curr.size, offset)){
+        return 0; 
+    }
+
+    if(end > limit){
+        end = limit; 
+    }
+    first = offset / fs->blocksize; 
+    nblocks = (end - 1) / fs->blocksize - first + 1; 
+    vec = (struct iovec *)malloc(sizeof(struct iovec)*(cursor->iovcnt + nblocks)); 
+    if(!vec){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+
+    if(first + nblocks > POINTERS_PER_INODE && curr.indirect != 0){
+        disk_read(fs->disk, curr.indirect, indirect.data); 
+        have_indirect = 1; 
+    }
+    if(first > 0 && first <= POINTERS_PER_INODE){
+        goal = curr.direct[first - 1]; 
+    } else if(first > POINTERS_PER_INODE && have_indirect){
+        goal = indirect.pointers[first - 1 - POINTERS_PER_INODE]; 
+    }
+    goal = goal ? goal + 1 : inode_goal(fs, inumber); 
+
+    for(i=0; i<nblocks; i++){
+        start = (first + i) * fs->blocksize; 
+        from = start > offset ? start : offset; 
+        to = start + fs->blocksize < end ? start + fs->blocksize : end; 
+        chunk = to - from; 
+
+        if(first + i < POINTERS_PER_INODE){
+            pointer = &curr.direct[first + i]; 
+        } else {
+            if(curr.indirect == 0){
+                curr.indirect = get_NEXT_AVAILABLE(fs, goal, inumber);
+                if(curr.indirect == -1){
+                    curr.indirect = 0; 
+                    break; // out of space
+                }
+                goal = curr.indirect + 1; 
+                memset(indirect.data, 0, fs->blocksize); 
+                have_indirect = 1; 
+                indirect_dirty = 1; 
+            }
+            pointer = &indirect.pointers[first + i - POINTERS_PER_INODE]; 
+        }
+
+        // a full block that is already on disk somewhere is shared instead of written
+        hash = DEDUP_NONE; 
+        if(fs->hashblocks && chunk == fs->blocksize){
+            cursor_copy(cursor, block.data, 0, chunk); 
+            hash = hash_block(block.data, chunk); 
+            match = dedup_lookup(fs, hash, block.data); 
+            if(match){
+                if(*pointer != 0){
+                    release_inumber(fs, *pointer); 
+                }
+                *pointer = match; 
+                indirect_dirty |= first + i >= POINTERS_PER_INODE; 
+                done += chunk; 
+                continue; 
+            }
+        }
+
+        fresh = *pointer == 0; 
+        shared = !fresh && !own_block(fs, *pointer) ? *pointer : 0; 
+        if(fresh || shared){
+            blocknum = get_NEXT_AVAILABLE(fs, goal, inumber); 
+            if(blocknum == -1){
+                break; // out of space
+            }
+            *pointer = blocknum; 
+            indirect_dirty |= first + i >= POINTERS_PER_INODE; 
+        }
+        blocknum = *pointer; 
+        goal = blocknum + 1; 
+
+        if(hash != DEDUP_NONE){
+            disk_write(fs->disk, blocknum, block.data); 
+            dedup_insert(fs, blocknum, hash); 
+        } else {
+            if(run_count > 0 && blocknum != run_start + run_count){
+                disk_writev(fs->disk, run_start, run_count, vec, nvec); 
+                nvec = 0; 
+                run_count = 0; 
+            }
+            if(run_count == 0){
+                run_start = blocknum; 
+            }
+            // only the first and last blocks can be partial, and they keep their own buffers
+            if(chunk < fs->blocksize){
+                buffer = i == 0 ? head.data : tail.data; 
+                if(fresh){
+                    memset(buffer, 0, fs->blocksize); 
+                } else {
+                    disk_read(fs->disk, shared ? shared : blocknum, buffer); 
+                }
+                cursor_copy(cursor, &buffer[from - start], 0, chunk); 
+                vec[nvec].iov_base = buffer; 
+                vec[nvec++].iov_len = fs->blocksize; 
+            } else {
+                cursor_slices(cursor, vec, &nvec, chunk); 
+            }
+            run_count++; 
+        }
+        if(shared){
+            release_inumber(fs, shared); // this inode now has its own copy
+        }
+        done += chunk; 
+    }
+
+    if(run_count > 0){
+        disk_writev(fs->disk, run_start, run_count, vec, nvec); 
+    }
+    free(vec); 
+    if(indirect_dirty){
+        disk_write(fs->disk, curr.indirect, indirect.data); 
+    }
+    if(done > 0 && offset + done > curr.size){
+        curr.size = offset + done; 
+    }
+    inode_save(fs, inumber, &curr); 
+    *inode = curr; 
+    return done; 
+}
+
+// the bytes in iov[0..iovcnt), or -1 if that does not fit in a file offset
+static int iov_total(const struct iovec *iov, int iovcnt){
+    size_t total = 0; 
+    int i; 
+
+    for(i=0; i<iovcnt; i++){
+        total += iov[i].iov_len; 
+        if(total > INT_MAX){
+            return -1; 
+        }
+    }
+    return (int)total; 
+}
+
+// the next piece of at most max bytes under the cursor, which moves past it
+static int cursor_next(struct iov_cursor *c, int max, char **base){
+    size_t n; 
+
+    while(c->skip == c->iov[c->index].iov_len){
+        c->index++; 
+        c->skip = 0; 
+    }
+    n = c->iov[c->index].iov_len - c->skip; 
+    if(n > (size_t)max){
+        n = max; 
+    }
+    *base = (char *)c->iov[c->index].iov_base + c->skip; 
+    c->skip += n; 
+    return (int)n; 
+}
+
+/*
+Move length bytes: out of the buffers into buf if buf is set, otherwise
+into the buffers from 'from', or zeros if that is null too.
+*/
+static void cursor_copy(struct iov_cursor *c, char *buf, const char *from, int length){
+    char *base; 
+    int n; 
+
+    for(; length > 0; length -= n){
+        n = cursor_next(c, length, &base); 
+        if(buf){
+            memcpy(buf, base, n); 
+            buf += n; 
+        } else if(from){
+            memcpy(base, from, n); 
+            from += n; 
+        } else {
+            memset(base, 0, n); 
+        }
+    }
+}
+
+// append the pieces of the buffers holding the next length bytes to vec
+static void cursor_slices(struct iov_cursor *c, struct iovec *vec, int *nvec, int length){
+    char *base; 
+    int n; 
+
+    for(; length > 0; length -= n){
+        n = cursor_next(c, length, &base); 
+        vec[*nvec].iov_base = base; 
+        vec[(*nvec)++].iov_len = n; 
+    }
+}
+
+/*
+Read-only views of a file for callers that only look at the data. There
+is no block cache to lend out, so fs_pin reads the range straight into
+one buffer of its own, each run of disk blocks in a single disk call, and
+hands back a reference per file block into it. The references are a
+snapshot: later writes do not change them, and they stay valid until
+fs_unpin, without holding any lock.
+*/
+int fs_pin( struct fs *fs, int inumber, int offset, int length, struct fs_blockref **refs )
+{
+    int limit = (POINTERS_PER_INODE + fs->pointers_per_block) * fs->blocksize; 
+    int nblocks, result; 
+    struct fs_blockref *r; 
+
+    *refs = 0; 
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+    if(length <= 0 || offset < 0 || offset >= limit){
+        return 0; 
+    }
+    if(length > limit - offset){
+        length = limit - offset; 
+    }
+
+    nblocks = (offset + length - 1) / fs->blocksize - offset / fs->blocksize + 1; 
+    r = (struct fs_blockref *)malloc((sizeof(struct fs_blockref) + fs->blocksize) * nblocks); 
+    if(!r){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    result = pin_range(fs, inumber, offset, length, (char *)(r + nblocks), r); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    if(result == 0){
+        free(r); 
+        return 0; 
+    }
+    *refs = r; 
+    return result; 
+}
+
+// the refs and their buffer are one allocation, so fs is not needed; it may even be closed by now
+void fs_unpin( struct fs *fs, struct fs_blockref *refs )
+{
+    free(refs); 
+}
+
+/*
+Call fn on every block of the file in order, SCAN_BLOCKS at a time, until
+it returns nonzero. The inode is only locked while each batch is read, so
+fn may use the file system. Returns the bytes passed to fn.
+*/
+int fs_scan( struct fs *fs, int inumber, int (*fn)( void *arg, const char *data, int length, int offset ), void *arg )
+{
+    struct fs_blockref *refs; 
+    int offset = 0, done = 0, stop = 0; 
+    int i, n; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+    refs = (struct fs_blockref *)malloc((sizeof(struct fs_blockref) + fs->blocksize) * SCAN_BLOCKS); 
+    if(!refs){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+
+    while(!stop){
+        pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+        n = pin_range(fs, inumber, offset, SCAN_BLOCKS * fs->blocksize, (char *)(refs + SCAN_BLOCKS), refs); 
+        pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+        if(n == 0){
+            break; 
+        }
+        for(i=0; i<n && !stop; i++){
+            stop = fn(arg, refs[i].data, refs[i].length, refs[i].offset); 
+            done += refs[i].length; 
+        }
+        offset += SCAN_BLOCKS * fs->blocksize; 
+    }
+
+    free(refs); 
+    return done; 
+}
+
+/*
+Fill buffer, laid out one block per file block of the range, with file
+bytes [offset,offset+length) cut short at the end of the file, and point
+refs[] at them. Returns the number of refs, 0 past the end.
+*/
+static int pin_range(struct fs *fs, int inumber, int offset, int length, char *buffer, struct fs_blockref *refs)
+{
+    struct fs_inode curr; 
+    int first, nblocks, i, run, start, from, to; 
+    int *blocks; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    if(offset >= curr.size){
+        return 0; 
+    }
+    if(length > curr.size - offset){
+        length = curr.size - offset; 
+    }
+
+    first = offset / fs->blocksize; 
+    nblocks = (offset + length - 1) / fs->blocksize - first + 1; 
+    if(curr.isvalid & INODE_INLINE){
+        memcpy(buffer, &curr.data[offset], length); 
+        refs[0].data = buffer; 
+        refs[0].offset = offset; 
+        refs[0].length = length; 
+        return 1; 
+    }
+
+    if(curr.isvalid & INODE_COMPRESSED){
+        if(read_clusters(fs, &curr, buffer + offset % fs->blocksize, length, offset) != length){
+            return 0; 
+        }
+    } else {
+        blocks = (int *)malloc(sizeof(int)*nblocks); 
+        if(!blocks){
+            fprintf(stderr, "Out of memory\n"); 
+            return 0; 
+        }
+        resolve_blocks(fs, &curr, first, nblocks, blocks); 
+        for(i=0; i<nblocks; i+=run){
+            run = 1; 
+            while(i+run < nblocks && blocks[i] != 0 && blocks[i+run] == blocks[i] + run){
+                run++; 
+            }
+            if(blocks[i] == 0){
+                memset(buffer + i * fs->blocksize, 0, fs->blocksize); 
+            } else {
+                disk_read_blocks(fs->disk, blocks[i], run, buffer + i * fs->blocksize); 
+            }
+        }
+        free(blocks); 
+    }
+
+    for(i=0; i<nblocks; i++){
+        start = (first + i) * fs->blocksize; 
+        from = start > offset ? start : offset; 
+        to = start + fs->blocksize < offset + length ? start + fs->blocksize : offset + length; 
+        refs[i].data = buffer + i * fs->blocksize + (from - start); 
+        refs[i].offset = from; 
+        refs[i].length = to - from; 
+    }
+    return nblocks; 
+}
+
+/*
+Make a new inode with the same contents as inumber by sharing its data
+blocks, so only the inode and a copy of the indirect block are written.
+Later writes to either file copy just the blocks they change.
+*/
+int fs_clone( struct fs *fs, int inumber )
+{
+    struct fs_inode curr; 
+    union fs_block indirect; 
+    int clone, found, copy, i, p; 
+
+    clone = fs_create(fs); 
+    if(clone <= 0){
+        return clone; 
+    }
+
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    found = inode_load(fs, inumber, &curr) && curr.isvalid != 0; 
+    if(found && !(curr.isvalid & INODE_INLINE)){
+        for(i=0; i<POINTERS_PER_INODE && found; i++){
+            if(curr.direct[i] != 0 && !share_block(fs, curr.direct[i])){
+                unshare_blocks(fs, curr.direct, i); 
+                found = 0; 
+            }
+        }
+        if(found && curr.indirect != 0){
+            copy = get_NEXT_AVAILABLE(fs, curr.indirect + 1, 0); 
+            if(copy == -1){
+                unshare_blocks(fs, curr.direct, POINTERS_PER_INODE); 
+                found = 0; 
+            } else {
+                disk_read(fs->disk, curr.indirect, indirect.data); 
+                for(p=0; p<fs->pointers_per_block && found; p++){
+                    if(indirect.pointers[p] != 0 && !share_block(fs, indirect.pointers[p])){
+                        unshare_blocks(fs, indirect.pointers, p); 
+                        unshare_blocks(fs, curr.direct, POINTERS_PER_INODE); 
+                        release_inumber(fs, copy); 
+                        found = 0; 
+                    }
+                }
+                if(found){
+                    disk_write(fs->disk, copy, indirect.data); 
+                    curr.indirect = copy; 
+                }
+            }
+        }
+    } else if(!found){
+        fprintf(stderr, "Inode does not exist\n"); 
+    }
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    if(!found){
+        fs_delete(fs, clone); 
+        return 0; 
+    }
+
+    // the copy has no name of its own
+    curr.isvalid &= ~(INODE_NAMED | INODE_DIRECTORY); 
+    pthread_rwlock_wrlock(inode_lock(fs, clone)); 
+    inode_save(fs, clone, &curr); 
+    pthread_rwlock_unlock(inode_lock(fs, clone)); 
+    return clone; 
+}
+
+/*
+Store an empty file compressed from now on. Every later write is
+compressed a cluster at a time, and reads decompress on the fly.
+*/
+int fs_compress( struct fs *fs, int inumber )
+{
+    struct fs_inode curr; 
+    int result = 0; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+    } else if(curr.size != 0){
+        fprintf(stderr, "Only an empty file can be made compressed\n"); 
+    } else {
+        if(curr.isvalid & INODE_INLINE){
+            memset(curr.data, 0, sizeof(curr.data)); 
+        }
+        curr.isvalid = (curr.isvalid & ~INODE_INLINE) | INODE_COMPRESSED; 
+        inode_save(fs, inumber, &curr); 
+        result = 1; 
+    }
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+/*
+Create an empty file under name. Returns its inumber, or 0 if the name is
+taken, invalid, or there is no room, which includes a directory at the
+size limit dir_capacity gives.
+*/
+int fs_create_named( struct fs *fs, const char *name )
+{
+    union fs_block bucket; 
+    int inumber, slot, fileblock; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+    if(!name[0] || strlen(name) > FS_NAME_MAX){
+        fprintf(stderr, "Names must be 1 to %d bytes\n", FS_NAME_MAX); 
+        return 0; 
+    }
+
+    pthread_rwlock_wrlock(&fs->dir_lock); 
+    if(!dir_open(fs)){
+        pthread_rwlock_unlock(&fs->dir_lock); 
+        return 0; 
+    }
+    if(dir_find(fs, name, &bucket, &fileblock) >= 0){
+        pthread_rwlock_unlock(&fs->dir_lock); 
+        fprintf(stderr, "%s already exists\n", name); 
+        return 0; 
+    }
+    inumber = fs_create(fs); 
+    if(inumber <= 0){
+        pthread_rwlock_unlock(&fs->dir_lock); 
+        return 0; 
+    }
+
+    slot = inumber - FIRST_INUMBER; 
+
+    if(!dir_insert(fs, name, slot)){
+        fs_delete(fs, inumber); 
+        inumber = 0; 
+    } else {
+        set_named(fs, inumber, 1); 
+    }
+    pthread_rwlock_unlock(&fs->dir_lock); 
+    return inumber; 
+}
+
+// inumber of the file called name, or 0 if there is none
+int fs_lookup( struct fs *fs, const char *name )
+{
+    union fs_block bucket; 
+    int inumber = 0; 
+    int fileblock, entry; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    pthread_rwlock_rdlock(&fs->dir_lock); 
+    if(fs->dir_inumber != 0){
+        entry = dir_find(fs, name, &bucket, &fileblock); 
+        if(entry >= 0){
+            inumber = slot_to_inumber(fs, bucket.bucket.entries[entry].slot); 
+        }
+    }
+    pthread_rwlock_unlock(&fs->dir_lock); 
+    return inumber; 
+}
+
+// remove name and delete the file it names
+int fs_unlink( struct fs *fs, const char *name )
+{
+    union fs_block bucket; 
+    int inumber = 0; 
+    int fileblock, entry, last; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    pthread_rwlock_wrlock(&fs->dir_lock); 
+    entry = fs->dir_inumber != 0 ? dir_find(fs, name, &bucket, &fileblock) : -1; 
+    if(entry >= 0){
+        inumber = slot_to_inumber(fs, bucket.bucket.entries[entry].slot); 
+        last = --bucket.bucket.count; 
+        bucket.bucket.entries[entry] = bucket.bucket.entries[last]; 
+        memset(&bucket.bucket.entries[last], 0, sizeof(struct fs_dirent)); 
+        if(!dir_write(fs, fileblock, &bucket)){
+            inumber = 0; 
+        }
+    }
+    pthread_rwlock_unlock(&fs->dir_lock); 
+
+    if(inumber == 0){
+        fprintf(stderr, "%s does not exist\n", name); 
+        return 0; 
+    }
+    set_named(fs, inumber, 0); 
+    return fs_delete(fs, inumber) == 1; 
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name){
+    uint32_t h = 2166136261u; 
+    while(*name){
+        h = (h ^ (unsigned char)*name++) * 16777619u; 
+    }
+    return h; 
+}
+
+/*
+Make sure the directory exists, creating it with one empty bucket the
+first time a name is added. The caller holds dir_lock for writing.
+*/
+static int dir_open(struct fs *fs){
+    union fs_block block; 
+    struct fs_inode curr; 
+    int inumber, slot; 
+
+    if(fs->dir_inumber != 0){
+        return 1; 
+    }
+    inumber = fs_create(fs); 
+    if(inumber <= 0){
+        return 0; 
+    }
+    fs->dir_inumber = inumber; 
+
+    memset(block.data, 0, fs->blocksize); 
+    block.header.depth = 0; 
+    block.header.nblocks = 2; 
+    block.header.table[0] = 1; 
+    if(!dir_write(fs, 0, &block)){
+        fs->dir_inumber = 0; 
+        fs_delete(fs, inumber); 
+        return 0; 
+    }
+    memset(block.data, 0, fs->blocksize); 
+    if(!dir_write(fs, 1, &block)){
+        fs->dir_inumber = 0; 
+        fs_delete(fs, inumber); 
+        return 0; 
+    }
+
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    inode_load(fs, inumber, &curr); 
+    curr.isvalid |= INODE_DIRECTORY; 
+    inode_save(fs, inumber, &curr); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    // record it in the superblock so the next mount can find it
+    slot = inumber - FIRST_INUMBER; 
+    disk_read(fs->disk, 0, block.data); 
+    block.super.dirslot = slot + 1; 
+    disk_write(fs->disk, 0, block.data); 
+    return 1; 
+}
+
+static int dir_read(struct fs *fs, int fileblock, union fs_block *block){
+    return fs_read(fs, fs->dir_inumber, block->data, fs->blocksize, fileblock * fs->blocksize) == fs->blocksize; 
+}
+
+static int dir_write(struct fs *fs, int fileblock, union fs_block *block){
+    return fs_write(fs, fs->dir_inumber, block->data, fs->blocksize, fileblock * fs->blocksize) == fs->blocksize; 
+}
+
+/*
+Look name up: two directory block reads, the header and one bucket.
+Returns the entry's index in bucket, which is left loaded along with its
+file block number, or -1 if name is not there.
+*/
+static int dir_find(struct fs *fs, const char *name, union fs_block *bucket, int *fileblock){
+    union fs_block header; 
+    uint32_t h = hash_name(name); 
+    int i; 
+
+    if(!dir_read(fs, 0, &header)){
+        return -1; 
+    }
+    *fileblock = header.header.table[h & ((1u << header.header.depth) - 1)]; 
+    if(!dir_read(fs, *fileblock, bucket)){
+        return -1; 
+    }
+    for(i=0; i<bucket->bucket.count; i++){
+        if(!strncmp(bucket->bucket.entries[i].name, name, FS_NAME_MAX + 1)){
+            return i; 
+        }
+    }
+    return -1; 
+}
+
+/*
+Add an entry, splitting the full bucket it hashes to (and doubling the
+table when that bucket is already as deep as it) until there is room.
+*/
+static int dir_insert(struct fs *fs, const char *name, int slot){
+    union fs_block header; 
+    union fs_block bucket; 
+    union fs_block sibling; 
+    uint32_t h = hash_name(name); 
+    int per_bucket = (fs->blocksize - 2 * sizeof(int)) / sizeof(struct fs_dirent); 
+    int table_size = (fs->blocksize - 2 * sizeof(int)) / sizeof(unsigned short); 
+    int max_blocks = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int fileblock, newblock, depth, i, n; 
+
+    if(!dir_read(fs, 0, &header)){
+        return 0; 
+    }
+    while(1){
+        fileblock = header.header.table[h & ((1u << header.header.depth) - 1)]; 
+        if(!dir_read(fs, fileblock, &bucket)){
+            return 0; 
+        }
+        if(bucket.bucket.count < per_bucket){
+            break; 
+        }
+
+        depth = bucket.bucket.depth; 
+        if(depth == header.header.depth){
+            if(depth == DIR_MAX_DEPTH || 2 << depth > table_size){
+                fprintf(stderr, "Directory is full (room for at most %d names with this block size)\n", dir_capacity(fs)); 
+                return 0; 
+            }
+            memcpy(&header.header.table[1 << depth], header.header.table, (1 << depth) * sizeof(unsigned short)); 
+            header.header.depth++; 
+        }
+        if(header.header.nblocks >= max_blocks){
+            fprintf(stderr, "Directory is full (room for at most %d names with this block size)\n", dir_capacity(fs)); 
+            return 0; 
+        }
+        newblock = header.header.nblocks++; 
+
+        // entries with bit depth of the hash set move to the new bucket
+        memset(sibling.data, 0, fs->blocksize); 
+        sibling.bucket.depth = depth + 1; 
+        bucket.bucket.depth = depth + 1; 
+        for(i=0, n=0; i<bucket.bucket.count; i++){
+            if(hash_name(bucket.bucket.entries[i].name) & (1u << depth)){
+                sibling.bucket.entries[sibling.bucket.count++] = bucket.bucket.entries[i]; 
+            } else {
+                bucket.bucket.entries[n++] = bucket.bucket.entries[i]; 
+            }
+        }
+        memset(&bucket.bucket.entries[n], 0, (bucket.bucket.count - n) * sizeof(struct fs_dirent)); 
+        bucket.bucket.count = n; 
+        for(i=0; i < 1 << header.header.depth; i++){
+            if(header.header.table[i] == fileblock && (i & (1 << depth))){
+                header.header.table[i] = newblock; 
+            }
+        }
+        if(!dir_write(fs, newblock, &sibling) || !dir_write(fs, fileblock, &bucket) || !dir_write(fs, 0, &header)){
+            return 0; 
+        }
+    }
+
+    bucket.bucket.entries[bucket.bucket.count].slot = slot; 
+    strncpy(bucket.bucket.entries[bucket.bucket.count].name, name, FS_NAME_MAX + 1); 
+    bucket.bucket.count++; 
+    return dir_write(fs, fileblock, &bucket); 
+}
+
+/*
+The most names the directory could hold with every bucket full: buckets
+are limited by the blocks an inode can address, by the table entries
+that fit in the header, and by DIR_MAX_DEPTH.
+*/
+static int dir_capacity(struct fs *fs){
+    int per_bucket = (fs->blocksize - 2 * sizeof(int)) / sizeof(struct fs_dirent); 
+    int table_size = (fs->blocksize - 2 * sizeof(int)) / sizeof(unsigned short); 
+    int buckets = POINTERS_PER_INODE + fs->pointers_per_block - 1; 
+    int depth = 0; 
+
+    while(depth < DIR_MAX_DEPTH && 2 << depth <= table_size){
+        depth++; 
+    }
+    if(buckets > 1 << depth){
+        buckets = 1 << depth; 
+    }
+    return buckets * per_bucket; 
+}
+
+static int slot_to_inumber(struct fs *fs, int slot){
+    return slot >= 0 && slot < fs->ninodes && slot_used(fs, slot) ? slot + FIRST_INUMBER : 0; 
+}
+
+// whether fs_create has handed out the slot; a free one is not worth a disk read
+static int slot_used(struct fs *fs, int slot){
+    struct fs_group *group = &fs->groups[slot_group(fs, slot)]; 
+    int used; 
+    pthread_mutex_lock(&group->lock); 
+    used = !bit_get(group->free_slot_map, slot - group->first_slot); 
+    pthread_mutex_unlock(&group->lock); 
+    return used; 
+}
+
+static int set_named(struct fs *fs, int inumber, int named){
+    struct fs_inode curr; 
+    int found; 
+
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    found = inode_load(fs, inumber, &curr) && curr.isvalid != 0; 
+    if(found){
+        if(named){
+            curr.isvalid |= INODE_NAMED; 
+        } else {
+            curr.isvalid &= ~INODE_NAMED; 
+        }
+        inode_save(fs, inumber, &curr); 
+    }
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return found; 
+}
+
+// number of runs of consecutive disk blocks holding a file's data, 0 if it has none
+int fs_fragments( struct fs *fs, int inumber )
+{
+    struct fs_inode curr; 
+    int nmax = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int *blocks; 
+    int runs = -1; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return -1; 
+    }
+    blocks = (int *)malloc(sizeof(int) * nmax); 
+    if(!blocks){
+        fprintf(stderr, "Out of memory\n"); 
+        return -1; 
+    }
+
+    pthread_rwlock_rdlock(inode_lock(fs, inumber)); 
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+    } else if(curr.isvalid & INODE_INLINE){
+        runs = 0; 
+    } else {
+        resolve_blocks(fs, &curr, 0, nmax, blocks); 
+        runs = count_runs(blocks, nmax); 
+    }
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+
+    free(blocks); 
+    return runs; 
+}
+
+/*
+Move fragmented files into contiguous runs, copying at most budget blocks
+so it can be run a little at a time on a live image; each call carries on
+from the inode where the last one stopped. A file larger than the budget
+is still moved if it is the first one the call finds. Files that share
+blocks with a clone or through dedup are left alone, since moving them
+would unshare the blocks. Returns the number of blocks moved.
+*/
+int fs_defrag( struct fs *fs, int budget )
+{
+    int nmax = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int moved = 0; 
+    int checked, inumber, result; 
+    int *blocks, *moved_to; 
+    char *buf; 
+
+    if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    // one set of buffers for the whole pass
+    blocks = (int *)malloc(sizeof(int) * nmax); 
+    moved_to = (int *)malloc(sizeof(int) * nmax); 
+    buf = (char *)malloc(DEFRAG_CHUNK * fs->blocksize); 
+    if(!blocks || !moved_to || !buf){
+        fprintf(stderr, "Out of memory\n"); 
+        free(blocks); free(moved_to); free(buf); 
+        return 0; 
+    }
+
+    pthread_mutex_lock(&fs->defrag_lock); 
+    if(fs->defrag_next < FIRST_INUMBER || fs->defrag_next >= fs->ninodes + FIRST_INUMBER){
+        fs->defrag_next = FIRST_INUMBER; 
+    }
+    for(checked = 0; checked < fs->ninodes && moved < budget; checked++){
+        inumber = fs->defrag_next; 
+        pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+        result = defrag_inode(fs, inumber, moved ? budget - moved : fs->nblocks, blocks, moved_to, buf); 
+        pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+        if(result < 0){
+            break; // does not fit in what is left of the budget; start here next time
+        }
+        moved += result; 
+        fs->defrag_next = inumber + 1 == fs->ninodes + FIRST_INUMBER ? FIRST_INUMBER : inumber + 1; 
+    }
+    pthread_mutex_unlock(&fs->defrag_lock); 
+
+    free(blocks); 
+    free(moved_to); 
+    free(buf); 
+    return moved; 
+}
+
+static int count_runs(const int *blocks, int nblocks){
+    int runs = 0; 
+    int last = 0; 
+    int i; 
+
+    for(i=0; i<nblocks; i++){
+        if(blocks[i] == 0){
+            continue; 
+        }
+        if(last == 0 || blocks[i] != last + 1){
+            runs++; 
+        }
+        last = blocks[i]; 
+    }
+    return runs; 
+}
+
+/*
+Copy one file's blocks to a free run: the indirect block first, then the
+data blocks in file order with the holes squeezed out. The new indirect
+block is written before the inode, so the switch to the new blocks is a
+single inode write, and the old blocks are only released after it.
+Returns the blocks moved, 0 if the file was skipped, or -1 if it needs
+more than budget.
+*/
+static int defrag_inode(struct fs *fs, int inumber, int budget, int *blocks, int *moved_to, char *buf){
+    struct fs_inode curr; 
+    union fs_block indirect; 
+    int nmax = POINTERS_PER_INODE + fs->pointers_per_block; 
+    int from[DEFRAG_CHUNK]; 
+    uint32_t hash; 
+    int n = 0, shared = 0, count = 0, to = 0; 
+    int need, start, next, old_indirect, i; 
+    struct fs_group *group; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0 || (curr.isvalid & INODE_INLINE)){
+        return 0; 
+    }
+    old_indirect = curr.indirect; 
+    resolve_blocks(fs, &curr, 0, nmax, blocks); 
+    if(count_runs(blocks, nmax) <= 1){
+        return 0; 
+    }
+
+    for(i=0; i<nmax; i++){
+        if(blocks[i] != 0){
+            group = block_group(fs, blocks[i]); 
+            pthread_mutex_lock(&group->lock); 
+            n++; 
+            shared |= block_refs(group, blocks[i]) > 1; 
+            pthread_mutex_unlock(&group->lock); 
+        }
+    }
+    if(shared){
+        return 0; 
+    }
+
+    need = n + (curr.indirect != 0); 
+    if(need > budget){
+        return -1; 
+    }
+    start = get_NEXT_AVAILABLE_run(fs, need, inode_goal(fs, inumber)); 
+    if(start == -1){
+        return 0; // no free run that long
+    }
+
+    // copy the data blocks in file order, a chunk at a time
+    next = start + (curr.indirect != 0); 
+    for(i=0; i<nmax; i++){
+        moved_to[i] = blocks[i] != 0 ? next++ : 0; 
+        if(blocks[i] == 0){
+            continue; 
+        }
+        if(count == 0){
+            to = moved_to[i]; 
+        }
+        from[count++] = blocks[i]; 
+        if(count == DEFRAG_CHUNK){
+            copy_blocks(fs, from, to, count, buf); 
+            count = 0; 
+        }
+    }
+    if(count){
+        copy_blocks(fs, from, to, count, buf); 
+    }
+
+    // switch the inode over
+    if(curr.indirect != 0){
+        memset(indirect.data, 0, fs->blocksize); 
+        for(i=POINTERS_PER_INODE; i<nmax; i++){
+            indirect.pointers[i - POINTERS_PER_INODE] = moved_to[i]; 
+        }
+        disk_write(fs->disk, start, indirect.data); 
+        curr.indirect = start; 
+    }
+    for(i=0; i<POINTERS_PER_INODE; i++){
+        curr.direct[i] = moved_to[i]; 
+    }
+    inode_save(fs, inumber, &curr); 
+    if(old_indirect != 0){
+        release_inumber(fs, old_indirect); 
+    }
+
+    // the dedup index follows the data to its new home
+    for(i=0; i<nmax; i++){
+        if(blocks[i] == 0){
+            continue; 
+        }
+        hash = DEDUP_NONE; 
+        if(fs->hashblocks){
+            pthread_mutex_lock(&fs->dedup_lock); 
+            hash = fs->block_hash[blocks[i]]; 
+            pthread_mutex_unlock(&fs->dedup_lock); 
+        }
+        release_inumber(fs, blocks[i]); 
+        if(hash != DEDUP_NONE){
+            dedup_insert(fs, moved_to[i], hash); 
+        }
+    }
+    return need; 
+}
+
+// copy the blocks in from[] to count consecutive blocks at to, reading each run of them at once
+static void copy_blocks(struct fs *fs, const int *from, int to, int count, char *buf){
+    int i, run; 
+
+    for(i=0; i<count; i+=run){
+        for(run=1; i+run<count && from[i+run] == from[i] + run; run++); 
+        disk_read_blocks(fs->disk, from[i], run, buf + i * fs->blocksize); 
+    }
+    disk_write_blocks(fs->disk, to, count, buf); 
+}
+
+int fs_truncate( struct fs *fs, int inumber, int size )
+{
+	if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    result = inode_truncate(fs, inumber, size); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+/*
+Shrinking frees every block past the new end, and the indirect block once
+no indirect pointers are left. Growing only moves the size, so the new
+range is a hole.
+*/
+static int inode_truncate(struct fs *fs, int inumber, int size)
+{
+    struct fs_inode curr; 
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    if(size < 0 || (size > 0 && determine_block(fs, size - 1) == -1)){
+        printf("size %d invalid\n", size);
+        return 0; 
+    }
+
+    if(curr.isvalid & INODE_INLINE){
+        if(size <= fs->inline_size){
+            if(size < curr.size){
+                memset(&curr.data[size], 0, curr.size - size); 
+            }
+            curr.size = size; 
+            inode_save(fs, inumber, &curr); 
+            return 1; 
+        }
+        if(!inline_to_blocks(fs, inumber, &curr)){
+            return 0; 
+        }
+    }
+
+    if(curr.isvalid & INODE_COMPRESSED){
+        if(!truncate_clusters(fs, &curr, size)){
+            return 0; 
+        }
+    } else if(size < curr.size){
+        release_tail(fs, &curr, size); 
+    } else if(size > curr.size && !zero_range(fs, inumber, &curr, curr.size, size)){
+        return 0; 
+    }
+    curr.size = size; 
+    inode_save(fs, inumber, &curr); 
+    return 1; 
+}
+
+int fs_fallocate( struct fs *fs, int inumber, int size )
+{
+	if(!fs->mounted){
+        fprintf(stderr, "File system not mounted\n"); 
+        return 0; 
+    }
+
+    int result; 
+    pthread_rwlock_wrlock(inode_lock(fs, inumber)); 
+    result = inode_fallocate(fs, inumber, size); 
+    pthread_rwlock_unlock(inode_lock(fs, inumber)); 
+    return result; 
+}
+
+/*
+Map every unmapped block below size, taking them (and the indirect block,
+if needed) as one contiguous run in file order so later writes land
+sequentially. The file size does not change. If no run is long enough the
+blocks are taken one at a time instead.
+*/
+static int inode_fallocate(struct fs *fs, int inumber, int size)
+{
+    struct fs_inode curr; 
+    union fs_block indirect; 
+    union fs_block zeros; 
+    int nblocks, need, need_indirect, start, next, b, blocknum, goal; 
+    int indirect_dirty = 0, result = 1; 
+    int *blocks; 
+
+    if(!inode_load(fs, inumber, &curr) || curr.isvalid == 0){
+        fprintf(stderr, "Inode does not exist\n"); 
+        return 0; 
+    }
+    if(size < 0 || (size > 0 && determine_block(fs, size - 1) == -1)){
+        printf("size %d invalid\n", size);
+        return 0; 
+    }
+    if(curr.isvalid & INODE_COMPRESSED){
+        // a cluster's block count is only known once its contents are
+        fprintf(stderr, "Cannot preallocate a compressed file\n"); 
+        return 0; 
+    }
+
+    if(curr.isvalid & INODE_INLINE){
+        if(size <= fs->inline_size){
+            return 1; 
+        }
+        if(!inline_to_blocks(fs, inumber, &curr)){
+            return 0; 
+        }
+    }
+
+    nblocks = (size + fs->blocksize - 1) / fs->blocksize; 
+    if(nblocks == 0){
+        return 1; 
+    }
+    blocks = (int *)malloc(sizeof(int)*nblocks); 
+    if(!blocks){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+    resolve_blocks(fs, &curr, 0, nblocks, blocks); 
+
+    need = 0; 
+    for(b=0; b<nblocks; b++){
+        if(blocks[b] == 0){
+            need++; 
+        }
+    }
+    need_indirect = nblocks > POINTERS_PER_INODE && curr.indirect == 0; 
+    if(need + need_indirect == 0){
+        free(blocks); 
+        return 1; 
+    }
+
+    // after the last block already mapped, or near the inode for an empty file
+    for(b=nblocks-1; b>=0 && blocks[b] == 0; b--); 
+    goal = b >= 0 ? blocks[b] + 1 : inode_goal(fs, inumber); 
+    start = get_NEXT_AVAILABLE_run(fs, need + need_indirect, goal); 
+    next = start; 
+    if(nblocks > POINTERS_PER_INODE && curr.indirect != 0){
+        disk_read(fs->disk, curr.indirect, indirect.data); 
+    }
+    memset(zeros.data, 0, fs->blocksize); 
+
+    for(b=0; b<nblocks; b++){
+        if(b == POINTERS_PER_INODE && need_indirect){
+            curr.indirect = start != -1 ? next++ : get_NEXT_AVAILABLE(fs, goal, inumber); 
+            if(curr.indirect == -1){
+                curr.indirect = 0; 
+                result = 0; 
+                break; 
+            }
+            memset(indirect.data, 0, fs->blocksize); 
+            indirect_dirty = 1; 
+        }
+        if(blocks[b] != 0){
+            continue; 
+        }
+        blocknum = start != -1 ? next++ : get_NEXT_AVAILABLE(fs, goal, inumber); 
+        if(blocknum == -1){
+            result = 0; // out of space; keep what was reserved
+            break; 
+        }
+        if(b < POINTERS_PER_INODE){
+            curr.direct[b] = blocknum; 
+        } else {
+            indirect.pointers[b - POINTERS_PER_INODE] = blocknum; 
+            indirect_dirty = 1; 
+        }
+        // a hole inside the file must still read as zeros
+        if(b * fs->blocksize < curr.size){
+            disk_write(fs->disk, blocknum, zeros.data); 
+        }
+    }
+
+    if(indirect_dirty){
+        disk_write(fs->disk, curr.indirect, indirect.data); 
+    }
+    inode_save(fs, inumber, &curr); 
+    free(blocks); 
+    return result; 
+}
+
+// move an inline inode's contents into its first block
+static int inline_to_blocks(struct fs *fs, int inumber, struct fs_inode *inode){
+    char old[MAX_INODE_SIZE]; 
+    int old_size = inode->size; 
+
+    memcpy(old, inode->data, old_size); 
+    memset(inode->data, 0, sizeof(inode->data)); 
+    inode->isvalid &= ~INODE_INLINE; 
+    inode->size = 0; 
+    if(old_size == 0){
+        inode_save(fs, inumber, inode); 
+        return 1; 
+    }
+    if(write_blocks(fs, inumber, inode, old, old_size, 0) != old_size){
+        // keep the contents inline rather than lose them
+        release_tail(fs, inode, 0); 
+        memcpy(inode->data, old, old_size); 
+        inode->isvalid |= INODE_INLINE; 
+        inode->size = old_size; 
+        inode_save(fs, inumber, inode); 
+        return 0; 
+    }
+    return 1; 
+}
+
+// zero the mapped parts of file bytes [from,to); holes are left alone
+static int zero_range(struct fs *fs, int inumber, struct fs_inode *inode, int from, int to){
+    return put_blocks(fs, inumber, inode, 0, to - from, from, 0) == to - from; 
+}
+
+// release every block holding file bytes at or past size
+static void release_tail(struct fs *fs, struct fs_inode *inode, int size){
+    union fs_block block; 
+    int keep = (size + fs->blocksize - 1) / fs->blocksize; 
+    int i, p, changed = 0; 
+
+    for(i=keep; i<POINTERS_PER_INODE; i++){
+        if(inode->direct[i] != 0){
+            release_inumber(fs, inode->direct[i]); 
+            inode->direct[i] = 0; 
+        }
+    }
+
+    if(inode->indirect == 0){
+        return; 
+    }
+    disk_read(fs->disk, inode->indirect, block.data); 
+    p = keep > POINTERS_PER_INODE ? keep - POINTERS_PER_INODE : 0; 
+    for(; p < fs->pointers_per_block; p++){
+        if(block.pointers[p] != 0){
+            release_inumber(fs, block.pointers[p]); 
+            block.pointers[p] = 0; 
+            changed = 1; 
+        }
+    }
+    if(keep <= POINTERS_PER_INODE){
+        release_inumber(fs, inode->indirect); 
+        inode->indirect = 0; 
+    } else if(changed){
+        disk_write(fs->disk, inode->indirect, block.data); 
+    }
+}
+
+/*
+Point file blocks first..first+nblocks-1 at blocks[], 0 meaning a hole,
+and return the blocks they pointed at before in old[]. The indirect block
+is created on demand. The inode is not saved.
+*/
+static int map_blocks(struct fs *fs, struct fs_inode *inode, int first, int nblocks, const int *blocks, int *old){
+    union fs_block indirect; 
+    int have_indirect = 0; 
+    int indirect_dirty = 0; 
+    int i, b, *pointer; 
+
+    for(i=0; i<nblocks; i++){
+        b = first + i; 
+        if(b < POINTERS_PER_INODE){
+            pointer = &inode->direct[b]; 
+        } else {
+            if(inode->indirect == 0){
+                if(blocks[i] == 0){
+                    old[i] = 0; 
+                    continue; 
+                }
+                inode->indirect = get_NEXT_AVAILABLE(fs, blocks[i], 0); 
+                if(inode->indirect == -1){
+                    inode->indirect = 0; 
+                    return 0; 
+                }
+                memset(indirect.data, 0, fs->blocksize); 
+                have_indirect = 1; 
+                indirect_dirty = 1; 
+            } else if(!have_indirect){
+                disk_read(fs->disk, inode->indirect, indirect.data); 
+                have_indirect = 1; 
+            }
+            pointer = &indirect.pointers[b - POINTERS_PER_INODE]; 
+            indirect_dirty = 1; 
+        }
+        old[i] = *pointer; 
+        *pointer = blocks[i]; 
+    }
+    if(indirect_dirty){
+        disk_write(fs->disk, inode->indirect, indirect.data); 
+    }
+    return 1; 
+}
+
+/*
+Decompress a whole cluster, stored in blocks[0..CLUSTER_BLOCKS), into buf.
+Bytes past its stored length are zeros.
+*/
+static int cluster_load(struct fs *fs, const int *blocks, int cluster, char *buf){
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    char *packed; 
+    int i, n, length; 
+
+    for(n=0; n<CLUSTER_BLOCKS && blocks[n] != 0; n++); 
+
+    if(n == 0){
+        memset(buf, 0, cluster_bytes); 
+        return 1; 
+    }
+    if(n == CLUSTER_BLOCKS){
+        for(i=0; i<n; i++){
+            disk_read(fs->disk, blocks[i], buf + i * fs->blocksize); 
+        }
+        return 1; 
+    }
+
+    packed = (char *)malloc(n * fs->blocksize); 
+    if(!packed){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+    for(i=0; i<n; i++){
+        disk_read(fs->disk, blocks[i], packed + i * fs->blocksize); 
+    }
+    memcpy(&length, packed, sizeof(int)); 
+    if(length >= 0 && length <= n * fs->blocksize - (int)sizeof(int)){
+        length = lz_decompress(packed + sizeof(int), length, buf, cluster_bytes); 
+    } else {
+        length = -1; 
+    }
+    free(packed); 
+    if(length < 0){
+        fprintf(stderr, "Corrupt compressed cluster %d\n", cluster); 
+        return 0; 
+    }
+    memset(buf + length, 0, cluster_bytes - length); 
+    return 1; 
+}
+
+/*
+Replace a cluster with the first length bytes of buf, compressed if that
+saves at least one block. New blocks are written before the old ones are
+released, so a failed store leaves the cluster as it was.
+*/
+static int cluster_store(struct fs *fs, struct fs_inode *inode, int cluster, char *buf, int length){
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    char *packed = 0; 
+    int blocks[CLUSTER_BLOCKS]; 
+    int old[CLUSTER_BLOCKS]; 
+    int i, n, start, goal, packed_length; 
+    const char *src = buf; 
+
+    memset(blocks, 0, sizeof(blocks)); 
+    n = 0; 
+    if(length > 0){
+        packed = (char *)malloc(cluster_bytes); 
+        if(!packed){
+            fprintf(stderr, "Out of memory\n"); 
+            return 0; 
+        }
+        packed_length = lz_compress(buf, length, packed + sizeof(int), (CLUSTER_BLOCKS - 1) * fs->blocksize - sizeof(int)); 
+        if(packed_length > 0){
+            memcpy(packed, &packed_length, sizeof(int)); 
+            n = (packed_length + sizeof(int) + fs->blocksize - 1) / fs->blocksize; 
+            memset(packed + sizeof(int) + packed_length, 0, n * fs->blocksize - packed_length - sizeof(int)); 
+            src = packed; 
+        } else {
+            memset(buf + length, 0, cluster_bytes - length); 
+            n = CLUSTER_BLOCKS; 
+        }
+
+        // after the last block of the cluster before this one
+        goal = 0; 
+        if(cluster > 0){
+            resolve_blocks(fs, inode, (cluster - 1) * CLUSTER_BLOCKS, CLUSTER_BLOCKS, old); 
+            for(i=0; i<CLUSTER_BLOCKS; i++){
+                goal = old[i] ? old[i] + 1 : goal; 
+            }
+        }
+        start = get_NEXT_AVAILABLE_run(fs, n, goal); 
+        for(i=0; i<n; i++){
+            blocks[i] = start != -1 ? start + i : get_NEXT_AVAILABLE(fs, goal, 0); 
+            if(blocks[i] == -1){
+                while(i-- > 0){
+                    release_inumber(fs, blocks[i]); 
+                }
+                free(packed); 
+                return 0; 
+            }
+            disk_write(fs->disk, blocks[i], src + i * fs->blocksize); 
+        }
+        free(packed); 
+    }
+
+    if(!map_blocks(fs, inode, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS, blocks, old)){
+        for(i=0; i<n; i++){
+            release_inumber(fs, blocks[i]); 
+        }
+        return 0; 
+    }
+    for(i=0; i<CLUSTER_BLOCKS; i++){
+        if(old[i] != 0){
+            release_inumber(fs, old[i]); 
+        }
+    }
+    return 1; 
+}
+
+// the caller has already clipped length to the file size
+static int read_clusters(struct fs *fs, struct fs_inode *inode, char *data, int length, int offset){
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    int first = offset / cluster_bytes; 
+    int nclusters = (offset + length - 1) / cluster_bytes - first + 1; 
+    char *buf = (char *)malloc(cluster_bytes); 
+    int *blocks = (int *)malloc(sizeof(int) * nclusters * CLUSTER_BLOCKS); 
+    int done = 0; 
+    int cluster, from, chunk; 
+
+    if(!buf || !blocks){
+        fprintf(stderr, "Out of memory\n"); 
+        free(buf); 
+        free(blocks); 
+        return 0; 
+    }
+    // one pass over the indirect block for the whole range
+    resolve_blocks(fs, inode, first * CLUSTER_BLOCKS, nclusters * CLUSTER_BLOCKS, blocks); 
+    while(done < length){
+        cluster = (offset + done) / cluster_bytes; 
+        from = (offset + done) % cluster_bytes; 
+        chunk = cluster_bytes - from < length - done ? cluster_bytes - from : length - done; 
+        if(!cluster_load(fs, &blocks[(cluster - first) * CLUSTER_BLOCKS], cluster, buf)){
+            break; 
+        }
+        memcpy(data + done, buf + from, chunk); 
+        done += chunk; 
+    }
+    free(buf); 
+    free(blocks); 
+    return done; 
+}
+
+// compressed counterpart of write_blocks: each touched cluster is rebuilt and stored again
+static int write_clusters(struct fs *fs, int inumber, struct fs_inode *inode, const char *data, int length, int offset){
+    struct fs_inode curr = *inode; 
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    int nclusters = (POINTERS_PER_INODE + fs->pointers_per_block) / CLUSTER_BLOCKS; 
+    char *buf = (char *)malloc(cluster_bytes); 
+    int blocks[CLUSTER_BLOCKS]; 
+    int done = 0; 
+    int cluster, from, chunk, end; 
+
+    if(!buf){
+        fprintf(stderr, "Out of memory\n"); 
+        return 0; 
+    }
+    while(done < length){
+        cluster = (offset + done) / cluster_bytes; 
+        if(cluster >= nclusters){
+            break; 
+        }
+        from = (offset + done) % cluster_bytes; 
+        chunk = cluster_bytes - from < length - done ? cluster_bytes - from : length - done; 
+
+        // a cluster that is overwritten completely need not be read
+        if(chunk < cluster_bytes){
+            resolve_blocks(fs, &curr, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS, blocks); 
+            if(!cluster_load(fs, blocks, cluster, buf)){
+                break; 
+            }
+        }
+        memcpy(buf + from, data + done, chunk); 
+
+        end = cluster * cluster_bytes + from + chunk; 
+        if(end < curr.size){
+            end = curr.size < (cluster + 1) * cluster_bytes ? curr.size : (cluster + 1) * cluster_bytes; 
+        }
+        if(!cluster_store(fs, &curr, cluster, buf, end - cluster * cluster_bytes)){
+            break; 
+        }
+        done += chunk; 
+        if(offset + done > curr.size){
+            curr.size = offset + done; 
+        }
+    }
+
+    free(buf); 
+    inode_save(fs, inumber, &curr); 
+    *inode = curr; 
+    return done; 
+}
+
+/*
+Set the size of a compressed file. Growing only moves the size, since
+everything past the old end already reads as zeros; shrinking stores the
+last cluster again without the cut bytes and drops the clusters after it.
+*/
+static int truncate_clusters(struct fs *fs, struct fs_inode *inode, int size){
+    int cluster_bytes = CLUSTER_BLOCKS * fs->blocksize; 
+    int nclusters = (POINTERS_PER_INODE + fs->pointers_per_block) / CLUSTER_BLOCKS; 
+    int cluster = size / cluster_bytes; 
+    int blocks[CLUSTER_BLOCKS]; 
+    int result; 
+    char *buf; 
+
+    if(size > nclusters * cluster_bytes){
+        printf("size %d invalid\n", size);
+        return 0; 
+    }
+    if(size >= inode->size){
+        return 1; 
+    }
+    if(size % cluster_bytes){
+        buf = (char *)malloc(cluster_bytes); 
+        if(!buf){
+            fprintf(stderr, "Out of memory\n"); 
+            return 0; 
+        }
+        resolve_blocks(fs, inode, cluster * CLUSTER_BLOCKS, CLUSTER_BLOCKS, blocks); 
+        result = cluster_load(fs, blocks, cluster, buf) && cluster_store(fs, inode, cluster, buf, size % cluster_bytes); 
+        free(buf); 
+        if(!result){
+            return 0; 
+        }
+        cluster++; 
+    }
+    release_tail(fs, inode, cluster * cluster_bytes); 
+    return 1; 
+}
+
+static int inode_load(struct fs *fs, int inumber, struct fs_inode * inode){
+    
+    union fs_block block; 
+    int slot = inumber - FIRST_INUMBER; 
+    if(slot < 0 || slot >= fs->ninodes || !slot_used(fs, slot)){
+        return 0; 
+    }
+    int inode_block = slot / fs->inodes_per_block + 1;
+    int i = slot % fs->inodes_per_block;
+
+    disk_read(fs->disk, inode_block, block.data); 
+    memset(inode, 0, sizeof(*inode)); 
+    memcpy(inode, inode_slot(fs, &block, i), fs->inodesize); 
+    if(inode->isvalid & INODE_ORPHAN){
+        memset(inode, 0, sizeof(*inode)); // already deleted
+    }
+    return 1; 
+}
+
+static void inode_save(struct fs *fs, int inumber, struct fs_inode * inode){
+    
+    int inode_block = (inumber - FIRST_INUMBER) / fs->inodes_per_block + 1;
+    int i = (inumber - FIRST_INUMBER) % fs->inodes_per_block;
+    union fs_block block; 
+
+    pthread_mutex_t *lock = &fs->itable_locks[inode_block % ITABLE_LOCKS]; 
+
+    // other inodes share this block, so the read-modify-write must not interleave
+    pthread_mutex_lock(lock); 
+    disk_read(fs->disk, inode_block, block.data); 
+    memcpy(inode_slot(fs, &block, i), inode, fs->inodesize); 
+    disk_write(fs->disk, inode_block, block.data); 
+    pthread_mutex_unlock(lock); 
+}
+
+static int determine_block(struct fs *fs, int offset){
+    int block_num = offset / fs->blocksize; 
+    if(block_num >= POINTERS_PER_INODE + fs->pointers_per_block){
+        return  -1; 
+    }
+    return block_num; 
+}
+
+static void set_geometry(struct fs *fs, int blocksize, int inodesize){
+    fs->blocksize = blocksize; 
+    fs->inodesize = inodesize; 
+    fs->inline_size = inodesize - offsetof(struct fs_inode, data); 
+    fs->inodes_per_block = blocksize / inodesize; 
+    fs->pointers_per_block = blocksize / sizeof(int); 
+}
+
+// on-disk inodes are fs->inodesize apart, which may be less than sizeof(struct fs_inode)
+static struct fs_inode * inode_slot(struct fs *fs, union fs_block *block, int slot){
+    return (struct fs_inode *)(block->data + slot * fs->inodesize); 
+}
+
+/*
+Read the superblock into block and switch the disk and fs to the block
+and inode sizes it records. The superblock fits in the smallest block, so it can be
+read before the block size is known. Returns 0 if the size is invalid.
+*/
+static int load_geometry(struct fs *fs, union fs_block *block){
+    int blocksize, inodesize; 
+
+    disk_set_blocksize(fs->disk, DISK_BLOCK_SIZE); 
+    disk_read(fs->disk, 0, block->data); 
+
+    blocksize = block->super.blocksize ? block->super.blocksize : DISK_BLOCK_SIZE; 
+    inodesize = block->super.inodesize ? block->super.inodesize : MIN_INODE_SIZE; 
+    if(inodesize < MIN_INODE_SIZE || inodesize > MAX_INODE_SIZE || (inodesize & (inodesize - 1))){
+        printf("Invalid inode size %d in superblock.\n", inodesize); 
+        return 0; 
+    }
+    if(!disk_set_blocksize(fs->disk, blocksize)){
+        printf("Invalid block size %d in superblock.\n", blocksize); 
+        disk_set_blocksize(fs->disk, DISK_BLOCK_SIZE); 
+        return 0; 
+    }
+    set_geometry(fs, blocksize, inodesize); 
+    return 1; 
+}
+
+/*
+Allocate a block as close after goal as possible: in the goal's group
+first, then in the groups after it. A file allocating with its inumber
+gets the goal if it is free; otherwise it reserves a window of
+ALLOC_WINDOW free blocks and takes the first. Its next blocks then come
+from the window, so files growing at the same time do not interleave.
+Other files only take blocks in windows once nothing else is free.
+
+Windows are aligned within their group and recorded by number in the
+group, so a window's free blocks are exactly the free blocks of its
+range, and they are kept out of the group's extents until it is dropped.
+*/
+static int get_NEXT_AVAILABLE(struct fs *fs, int goal, int inumber){
+	struct fs_group *group;
+	int b = -1, g, i, from, owner, since, window, recorded;
+	if( goal < fs->first_data_block || goal >= fs->nblocks ){
+		goal = fs->first_data_block;
+	}
+	group = block_group(fs, goal);
+	g = group - fs->groups;
+
+	pthread_mutex_lock(&group->lock);
+	if( block_refs(group, goal) == 0 ){
+		owner = intmap_get(&group->windows, (goal - group->first_block) / ALLOC_WINDOW, 0);
+		if( owner == 0 ){
+			extent_take(group, goal, 1);
+			b = goal;
+		} else if( owner == inumber ){
+			b = goal; // next block of the file's window
+		}
+	}
+	if( b != -1 ){
+		claim_blocks(group, b, 1);
+	}
+	pthread_mutex_unlock(&group->lock);
+	if( b != -1 ){
+		return b;
+	}
+
+	// the goal is gone, so the old window is no use to the file any more
+	if( inumber != 0 ){
+		drop_window(fs, inumber);
+	}
+	since = reclaim_generation(fs);
+	for( i = 0; i < fs->ngroups && b == -1; i++ ){
+		group = &fs->groups[(g + i) % fs->ngroups];
+		from = i == 0 ? goal : group->first_block;
+		pthread_mutex_lock(&group->lock);
+		if( group->free_blocks > 0 ){
+			if( inumber != 0 && (b = extent_find(group, from, ALLOC_WINDOW, ALLOC_WINDOW)) != -1 ){
+				extent_take(group, b, ALLOC_WINDOW);
+				window = (b - group->first_block) / ALLOC_WINDOW;
+				recorded = intmap_put(&group->windows, window, inumber);
+				if( recorded ){
+					pthread_mutex_lock(&fs->window_lock);
+					recorded = intmap_put(&fs->file_windows, inumber, b);
+					pthread_mutex_unlock(&fs->window_lock);
+					if( !recorded ){
+						intmap_remove(&group->windows, window);
+					}
+				}
+				if( !recorded ){
+					extent_free(group, b + 1, ALLOC_WINDOW - 1); // no window, just the block
+				}
+			} else if( (b = extent_find(group, from, 1, 1)) != -1 ){
+				extent_take(group, b, 1);
+			}
+			if( b != -1 ){
+				claim_blocks(group, b, 1);
+			}
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	// all that is left is in windows
+	for( i = 0; i < fs->ngroups && b == -1; i++ ){
+		group = &fs->groups[(g + i) % fs->ngroups];
+		pthread_mutex_lock(&group->lock);
+		if( group->free_blocks > 0 ){
+			b = find_reserved(group, i == 0 ? goal : group->first_block);
+			if( b != -1 ){
+				extent_take(group, b, 1); // a block freed since the scan above may be back in the extents
+				claim_blocks(group, b, 1);
+			}
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	// deleted files may still be giving blocks back
+	if( b == -1 && reclaim_wait(fs, since) ){
+		return get_NEXT_AVAILABLE(fs, goal, inumber);
+	}
+	if( b == -1 ){
+		printf("Error: The disk is full.\n");
+	}
+	return b;
+}
+
+// count consecutive free blocks within one group, as close after goal as possible
+static int get_NEXT_AVAILABLE_run(struct fs *fs, int count, int goal){
+	struct fs_group *group;
+	int b = -1, g, i;
+	if( goal < fs->first_data_block || goal >= fs->nblocks ){
+		goal = fs->first_data_block;
+	}
+	g = block_group(fs, goal) - fs->groups;
+	for( i = 0; i < fs->ngroups && b == -1; i++ ){
+		group = &fs->groups[(g + i) % fs->ngroups];
+		pthread_mutex_lock(&group->lock);
+		if( group->free_blocks >= count ){
+			b = extent_find(group, i == 0 ? goal : group->first_block, count, 1);
+			if( b != -1 ){
+				extent_take(group, b, count);
+				claim_blocks(group, b, count);
+			}
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+	return b;
+}
+
+/*
+First free block at or after from, wrapping around to the start of the
+group. Only wanted once the group had no extents left, when every free
+block was in some window; blocks freed since then may be in the extents
+again. Caller holds the group lock.
+*/
+static int find_reserved(struct fs_group *group, int from){
+	int size = group->end_block - group->first_block;
+	int b = bit_find(group->used, from - group->first_block, size, 0);
+	if( b == -1 ){
+		b = bit_find(group->used, 0, size, 0);
+	}
+	return b == -1 ? -1 : group->first_block + b;
+}
+
+// caller holds the group lock and has taken the free blocks out of the extents or a window
+static void claim_blocks(struct fs_group *group, int start, int count){
+	int i;
+	for( i = start; i < start + count; i++ ){
+		bit_put(group->used, i - group->first_block, 1);
+	}
+	group->free_blocks -= count;
+}
+
+// give what is left of a file's window back to the extents; the caller has the file to itself
+static void drop_window(struct fs *fs, int inumber){
+	struct fs_group *group;
+	int start, i, n;
+
+	pthread_mutex_lock(&fs->window_lock);
+	start = intmap_get(&fs->file_windows, inumber, 0);
+	if( start != 0 ){
+		intmap_remove(&fs->file_windows, inumber);
+	}
+	pthread_mutex_unlock(&fs->window_lock);
+	if( start == 0 ){
+		return;
+	}
+
+	group = block_group(fs, start);
+	n = (start - group->first_block) / ALLOC_WINDOW;
+	pthread_mutex_lock(&group->lock);
+	if( intmap_get(&group->windows, n, 0) == inumber ){
+		intmap_remove(&group->windows, n);
+		for( i = start; i < start + ALLOC_WINDOW; i++ ){
+			if( block_refs(group, i) == 0 ){
+				extent_free(group, i, 1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+static void extent_update(struct fs_extent *e){
+	e->longest = e->length;
+	if( e->left && e->left->longest > e->longest ){
+		e->longest = e->left->longest;
+	}
+	if( e->right && e->right->longest > e->longest ){
+		e->longest = e->right->longest;
+	}
+}
+
+// split t into the extents starting before key and the rest
+static void extent_split(struct fs_extent *t, int key, struct fs_extent **before, struct fs_extent **after){
+	if( !t ){
+		*before = *after = 0;
+		return;
+	}
+	if( t->start < key ){
+		extent_split(t->right, key, &t->right, after);
+		*before = t;
+	} else {
+		extent_split(t->left, key, before, &t->left);
+		*after = t;
+	}
+	extent_update(t);
+}
+
+// join two treaps, every extent in before starting ahead of every one in after
+static struct fs_extent * extent_merge(struct fs_extent *before, struct fs_extent *after){
+	if( !before ){
+		return after;
+	}
+	if( !after ){
+		return before;
+	}
+	if( before->priority > after->priority ){
+		before->right = extent_merge(before->right, after);
+		extent_update(before);
+		return before;
+	}
+	after->left = extent_merge(before, after->left);
+	extent_update(after);
+	return after;
+}
+
+/*
+Without memory for the node the blocks are left out of the extents: the
+allocator cannot hand them out, but they are still free on disk, and the
+next mount finds them again.
+*/
+static struct fs_extent * extent_new(int start, int length){
+	struct fs_extent *e = (struct fs_extent *)malloc(sizeof(struct fs_extent));
+	if( !e ){
+		fprintf(stderr, "Out of memory\n");
+		return 0;
+	}
+	e->start = start;
+	e->length = length;
+	e->longest = length;
+	e->priority = (unsigned)start * 2654435761u; // scrambled, which keeps the treap balanced
+	e->left = e->right = 0;
+	return e;
+}
+
+// add blocks start..start+length-1 to the group's extents, joining the neighbours they touch
+static void extent_free(struct fs_group *group, int start, int length){
+	struct fs_extent *before, *after, *e, *joined;
+
+	// the node comes first, so a failure loses only these blocks and not the neighbours
+	joined = extent_new(start, length);
+	if( !joined ){
+		return;
+	}
+	extent_split(group->extents, start, &before, &after);
+	for( e = before; e && e->right; e = e->right );
+	if( e && e->start + e->length == start ){
+		extent_split(before, e->start, &before, &e);
+		start = e->start;
+		length += e->length;
+		free(e);
+	}
+	for( e = after; e && e->left; e = e->left );
+	if( e && start + length == e->start ){
+		extent_split(after, e->start + 1, &e, &after);
+		length += e->length;
+		free(e);
+	}
+	joined->start = start;
+	joined->length = length;
+	joined->longest = length;
+	joined->priority = (unsigned)start * 2654435761u;
+	group->extents = extent_merge(extent_merge(before, joined), after);
+}
+
+// remove blocks start..start+length-1, which lie in one extent, from the group's extents
+static void extent_take(struct fs_group *group, int start, int length){
+	struct fs_extent *before, *after, *e;
+	int end;
+
+	extent_split(group->extents, start + 1, &before, &after);
+	for( e = before; e && e->right; e = e->right );
+	if( !e || e->start + e->length < start + length ){
+		group->extents = extent_merge(before, after); // not free; the caller checked
+		return;
+	}
+	extent_split(before, e->start, &before, &e);
+	end = e->start + e->length;
+	if( e->start < start ){
+		e->length = start - e->start; // the node keeps the part ahead of the blocks taken
+		extent_update(e);
+		before = extent_merge(before, e);
+	} else {
+		free(e);
+	}
+	if( start + length < end ){
+		before = extent_merge(before, extent_new(start + length, end - start - length));
+	}
+	group->extents = extent_merge(before, after);
+}
+
+// the first extent starting at or after from that holds count blocks
+static struct fs_extent * extent_search(struct fs_extent *t, int from, int count){
+	struct fs_extent *e;
+	if( !t || t->longest < count ){
 		return 0;
 	}
+	if( t->start < from ){
+		return extent_search(t->right, from, count);
+	}
+	if( (e = extent_search(t->left, from, count)) ){
+		return e;
+	}
+	return t->length >= count ? t : extent_search(t->right, from, count);
+}
+
+/*
+First block of count free ones as close after from as possible, wrapping
+around the group. With align above 1 the run must start a multiple of
+align blocks into the group.
+*/
+static int extent_find(struct fs_group *group, int from, int count, int align){
+	struct fs_extent *t, *e;
+	int pass, key, start;
 
-    int offset_bytes = offset % DISK_BLOCK_SIZE;
-    int bytes_written = 0;
-    int curr_indirect_block; 
-    while(length > 0){ //b block_pointer < POINTERS_PER_BLOCK){
+	for( pass = 0; pass < 2; pass++ ){
+		key = pass == 0 ? from : group->first_block;
 
-        if(block_pointer == POINTERS_PER_INODE){ // creates space for indirect
-            curr.indirect = get_NEXT_AVAILABLE();
-			if(curr.indirect == -1){
-				return 0; // out of space
+		// the extent holding key if there is one, else the first long enough after it
+		e = 0;
+		for( t = group->extents; t; ){
+			if( t->start <= key ){
+				e = t;
+				t = t->right;
+			} else {
+				t = t->left;
 			}
-            disk_read(curr.indirect, block.data); 
-            for(x=0; x<POINTERS_PER_BLOCK; x++){
-                block.pointers[x] = 0; 
-            }
-            disk_write(curr.indirect, block.data); 
-        }
-		// gets block.data with disk read
-        if(block_pointer >= POINTERS_PER_INODE){ // indirect
-            disk_read(curr.indirect, block.data); 
-            for(x=0; x<POINTERS_PER_BLOCK; x++){
-                if(block.pointers[x] == 0){
-                    block.pointers[x] = get_NEXT_AVAILABLE();
-					if( block.pointers[x] == -1 ){
-						return 0; // out of space
-					}
-                    disk_write(curr.indirect, block.data);
-                    curr_indirect_block = block.pointers[x]; 
-                    break; 
-                }
-            }
-            disk_read(curr_indirect_block, block.data); 
-        }else { // direct
-            curr.direct[block_pointer] = get_NEXT_AVAILABLE(); 
-			if( curr.direct[block_pointer] == -1 ){
+		}
+		if( !e || e->start + e->length <= key ){
+			e = extent_search(group->extents, key, count);
+		}
+		for( ; e; e = extent_search(group->extents, e->start + 1, count) ){
+			start = e->start < key ? key : e->start;
+			start = group->first_block + (start - group->first_block + align - 1) / align * align;
+			if( start + count <= e->start + e->length ){
+				return start;
+			}
+		}
+	}
+	return -1;
+}
+
+static void extent_destroy(struct fs_extent *e){
+	if( e ){
+		extent_destroy(e->left);
+		extent_destroy(e->right);
+		free(e);
+	}
+}
+
+/*
+Where a file with no blocks yet should start: its inode's group, at the
+point of the group's data matching the inode's place in the group's part
+of the table, so files created together start near each other.
+*/
+static int inode_goal(struct fs *fs, int inumber){
+	struct fs_group *group;
+	int slot;
+	slot = inumber - FIRST_INUMBER;
+	if( slot < 0 || slot >= fs->ninodes ){
+		return fs->first_data_block;
+	}
+	group = &fs->groups[slot_group(fs, slot)];
+	return group->first_block + (int)((long long)(slot - group->first_slot) * (group->end_block - group->first_block) / (group->end_slot - group->first_slot));
+}
+
+// the group holding a block; blocks before the data area count as the first group's
+static struct fs_group * block_group(struct fs *fs, int blocknum){
+	int ndata = fs->nblocks - fs->first_data_block;
+	int g;
+	if( blocknum < fs->first_data_block ){
+		return &fs->groups[0];
+	}
+	g = (int)((long long)(blocknum - fs->first_data_block) * fs->ngroups / ndata);
+	g = g >= fs->ngroups ? fs->ngroups - 1 : g;
+	while( g > 0 && blocknum < fs->groups[g].first_block ){
+		g--;
+	}
+	while( g < fs->ngroups - 1 && blocknum >= fs->groups[g].end_block ){
+		g++;
+	}
+	return &fs->groups[g];
+}
+
+static int slot_group(struct fs *fs, int slot){
+	int g = (int)((long long)slot * fs->ngroups / fs->ninodes);
+	g = g >= fs->ngroups ? fs->ngroups - 1 : g;
+	while( g > 0 && slot < fs->groups[g].first_slot ){
+		g--;
+	}
+	while( g < fs->ngroups - 1 && slot >= fs->groups[g].end_slot ){
+		g++;
+	}
+	return g;
+}
+
+/*
+Split the data area and the inode table between the groups, the table
+on inode block boundaries, with every block and slot free until mount
+marks the ones in use.
+*/
+static void setup_groups(struct fs *fs, int ngroups){
+	struct fs_group *group;
+	int ndata = fs->nblocks - fs->first_data_block;
+	int inode_blocks = fs->ninodes / fs->inodes_per_block;
+	int g, i;
+
+	fs->ngroups = ngroups;
+	fs->groups = (struct fs_group *)calloc(ngroups, sizeof(struct fs_group));
+	for( g = 0; g < ngroups; g++ ){
+		group = &fs->groups[g];
+		pthread_mutex_init(&group->lock, 0);
+		group->first_block = fs->first_data_block + (int)((long long)g * ndata / ngroups);
+		group->end_block = fs->first_data_block + (int)((long long)(g + 1) * ndata / ngroups);
+		group->first_slot = g * inode_blocks / ngroups * fs->inodes_per_block;
+		group->end_slot = (g + 1) * inode_blocks / ngroups * fs->inodes_per_block;
+		group->used = (uint64_t *)calloc((group->end_block - group->first_block + 63) / 64, sizeof(uint64_t));
+		group->free_slot_map = (uint64_t *)calloc((group->end_slot - group->first_slot + 63) / 64, sizeof(uint64_t));
+		for( i = 0; i < group->end_slot - group->first_slot; i++ ){
+			bit_put(group->free_slot_map, i, 1);
+		}
+		group->free_slots = group->end_slot - group->first_slot;
+	}
+}
+
+// once every block in use is marked, fill in each group's free counts and extents
+static void fill_groups(struct fs *fs){
+	struct fs_group *group;
+	int g, i, run, size;
+
+	for( g = 0; g < fs->ngroups; g++ ){
+		group = &fs->groups[g];
+		size = group->end_block - group->first_block;
+		for( i = bit_find(group->used, 0, size, 0); i != -1; i = bit_find(group->used, run, size, 0) ){
+			run = bit_find(group->used, i, size, 1);
+			run = run == -1 ? size : run;
+			group->free_blocks += run - i;
+			extent_free(group, group->first_block + i, run - i);
+		}
+		group->slot_hint = 0;
+	}
+}
+
+/*
+A block's references: its used bit, plus the entry in shared if more
+than one file holds it. Blocks outside the group's data are metadata
+and always in use. Caller holds the group lock.
+*/
+static int block_refs(struct fs_group *group, int blocknum){
+	if( blocknum < group->first_block || blocknum >= group->end_block ){
+		return 1;
+	}
+	if( !bit_get(group->used, blocknum - group->first_block) ){
+		return 0;
+	}
+	return 1 + intmap_get(&group->shared, blocknum, 0);
+}
+
+// returns 0 if there is no memory to count another reference
+static int block_ref(struct fs_group *group, int blocknum){
+	int refs = block_refs(group, blocknum);
+	if( blocknum < group->first_block || blocknum >= group->end_block ){
+		return 1;
+	}
+	if( refs == 0 ){
+		bit_put(group->used, blocknum - group->first_block, 1);
+		return 1;
+	}
+	return intmap_put(&group->shared, blocknum, refs);
+}
+
+// returns the references left
+static int block_unref(struct fs_group *group, int blocknum){
+	int refs = block_refs(group, blocknum);
+	if( blocknum < group->first_block || blocknum >= group->end_block || refs == 0 ){
+		return refs;
+	}
+	if( refs == 1 ){
+		bit_put(group->used, blocknum - group->first_block, 0);
+	} else if( refs == 2 ){
+		intmap_remove(&group->shared, blocknum);
+	} else {
+		intmap_put(&group->shared, blocknum, refs - 2);
+	}
+	return refs - 1;
+}
+
+static int bit_get(const uint64_t *map, int i){
+	return map[i >> 6] >> (i & 63) & 1;
+}
+
+static void bit_put(uint64_t *map, int i, int value){
+	if( value ){
+		map[i >> 6] |= (uint64_t)1 << (i & 63);
+	} else {
+		map[i >> 6] &= ~((uint64_t)1 << (i & 63));
+	}
+}
+
+// first bit in from..end-1 equal to value, a word at a time, or -1
+static int bit_find(const uint64_t *map, int from, int end, int value){
+	uint64_t word;
+	int i = from;
+	while( i < end ){
+		word = value ? map[i >> 6] : ~map[i >> 6];
+		word &= ~(uint64_t)0 << (i & 63);
+		if( word ){
+			i = (i & ~63) + __builtin_ctzll(word);
+			return i < end ? i : -1;
+		}
+		i = (i & ~63) + 64;
+	}
+	return -1;
+}
+
+static int compare_ints(const void *a, const void *b){
+	int x = *(const int *)a, y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned intmap_home(struct fs_intmap *m, int key){
+	return ((unsigned)key * 2654435761u) & (m->size - 1);
+}
+
+static int intmap_get(struct fs_intmap *m, int key, int missing){
+	unsigned i;
+	if( m->size == 0 ){
+		return missing;
+	}
+	for( i = intmap_home(m, key); m->keys[i] != 0; i = (i + 1) & (m->size - 1) ){
+		if( m->keys[i] == key + 1 ){
+			return m->values[i];
+		}
+	}
+	return missing;
+}
+
+/*
+Returns 0 if a new key needs the map to grow and there is no memory for
+it. A map that cannot grow keeps taking keys while it has an empty slot
+to spare, and changing an existing key never fails.
+*/
+static int intmap_put(struct fs_intmap *m, int key, int value){
+	unsigned i;
+	if( m->size > 0 ){
+		for( i = intmap_home(m, key); m->keys[i] != 0; i = (i + 1) & (m->size - 1) ){
+			if( m->keys[i] == key + 1 ){
+				m->values[i] = value;
+				return 1;
+			}
+		}
+	}
+	if( (m->count + 1) * 2 > m->size ){
+		struct fs_intmap bigger;
+		bigger.size = m->size ? m->size * 2 : 16;
+		bigger.count = 0;
+		bigger.keys = (int *)calloc(bigger.size, sizeof(int));
+		bigger.values = (int *)malloc(sizeof(int) * bigger.size);
+		if( !bigger.keys || !bigger.values ){
+			free(bigger.keys);
+			free(bigger.values);
+			if( m->count + 2 > m->size ){
+				fprintf(stderr, "Out of memory\n");
 				return 0;
 			}
-            disk_read(curr.direct[block_pointer], block.data); 
-        }
-		// copy data
-        if ( DISK_BLOCK_SIZE - offset_bytes > length){
-			memcpy(&block.data[offset_bytes], data + bytes_written, length);
-			bytes_written += length;
-			length = 0;
-		} else{
-			memcpy(&block.data[offset_bytes], data + bytes_written, DISK_BLOCK_SIZE - offset_bytes);
-			bytes_written += DISK_BLOCK_SIZE - offset_bytes;
-			length -=  DISK_BLOCK_SIZE - offset_bytes;
+		} else {
+			for( i = 0; i < (unsigned)m->size; i++ ){
+				if( m->keys[i] != 0 ){
+					intmap_put(&bigger, m->keys[i] - 1, m->values[i]);
+				}
+			}
+			intmap_free(m);
+			*m = bigger;
 		}
-		// write data to disk
-        if(block_pointer >= 5){
-            disk_write(curr_indirect_block, block.data); 
-        }else {
-            disk_write(curr.direct[block_pointer], block.data); 
-        }
+	}
+	for( i = intmap_home(m, key); m->keys[i] != 0; i = (i + 1) & (m->size - 1) );
+	m->keys[i] = key + 1;
+	m->values[i] = value;
+	m->count++;
+	return 1;
+}
 
-        //update inode size
-        block_pointer++;
-    }   
-    curr.size = bytes_written + offset;
-    inode_save(inumber, &curr);
-    return bytes_written;
+// linear probing, so later entries of the run are moved up into the hole
+static void intmap_remove(struct fs_intmap *m, int key){
+	unsigned mask = m->size - 1, i, j, home;
+	if( m->size == 0 ){
+		return;
+	}
+	for( i = intmap_home(m, key); m->keys[i] != key + 1; i = (i + 1) & mask ){
+		if( m->keys[i] == 0 ){
+			return;
+		}
+	}
+	for( j = (i + 1) & mask; m->keys[j] != 0; j = (j + 1) & mask ){
+		home = intmap_home(m, m->keys[j] - 1);
+		// move j to i unless its home lies cyclically in i+1..j
+		if( ((j - home) & mask) >= ((j - i) & mask) ){
+			m->keys[i] = m->keys[j];
+			m->values[i] = m->values[j];
+			i = j;
+		}
+	}
+	m->keys[i] = 0;
+	m->count--;
 }
 
-void inode_load(int inumber, struct fs_inode * fs){
-    
-    union fs_block block; 
-    CURR_BLOCK = BLOCK_BITMAP[inumber];
-    int i = INODE_BITMAP[inumber];
+static void intmap_free(struct fs_intmap *m){
+	free(m->keys);
+	free(m->values);
+	memset(m, 0, sizeof(*m));
+}
 
-    disk_read(CURR_BLOCK, block.data); 
-    *fs = block.inode[i]; 
+// drop one reference to a block; it is free once nothing refers to it
+static void release_inumber(struct fs *fs, int inumber){
+	struct fs_group *group = block_group(fs, inumber);
+	pthread_mutex_lock(&group->lock);
+	if( block_refs(group, inumber) > 0 && block_unref(group, inumber) == 0 ){
+		group->free_blocks++;
+		// a block in a window goes back to the window, not the extents
+		if( intmap_get(&group->windows, (inumber - group->first_block) / ALLOC_WINDOW, 0) == 0 ){
+			extent_free(group, inumber, 1);
+		}
+		dedup_remove(fs, inumber);
+	}
+	pthread_mutex_unlock(&group->lock);
 }
 
-void inode_save(int inumber, struct fs_inode * fs){
-    
-    CURR_BLOCK = BLOCK_BITMAP[inumber];
-    int i = INODE_BITMAP[inumber];
-    union fs_block block; 
+/*
+release_inumber for many blocks: sorted, each group is locked once and
+every run of adjacent blocks freed outside a window goes back to the
+extents in one piece. Sorts blocks in place.
+*/
+static void release_blocks(struct fs *fs, int *blocks, int n){
+	struct fs_group *group;
+	int i = 0, run_start = 0, run_length = 0, b;
+
+	qsort(blocks, n, sizeof(int), compare_ints);
+	while( i < n ){
+		group = block_group(fs, blocks[i]);
+		pthread_mutex_lock(&group->lock);
+		for( ; i < n && (blocks[i] < group->end_block || group == &fs->groups[fs->ngroups - 1]); i++ ){
+			b = blocks[i];
+			if( block_refs(group, b) == 0 || block_unref(group, b) != 0 ){
+				continue;
+			}
+			group->free_blocks++;
+			dedup_remove(fs, b);
+			if( intmap_get(&group->windows, (b - group->first_block) / ALLOC_WINDOW, 0) != 0 ){
+				continue;
+			}
+			if( run_length > 0 && b == run_start + run_length ){
+				run_length++;
+				continue;
+			}
+			if( run_length > 0 ){
+				extent_free(group, run_start, run_length);
+			}
+			run_start = b;
+			run_length = 1;
+		}
+		if( run_length > 0 ){
+			extent_free(group, run_start, run_length);
+			run_length = 0;
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+}
 
-    disk_read(CURR_BLOCK, block.data); 
-    block.inode[i] = *fs; 
-    disk_write(CURR_BLOCK, block.data); 
+static int share_block(struct fs *fs, int blocknum){
+	struct fs_group *group = block_group(fs, blocknum);
+	int shared;
+	pthread_mutex_lock(&group->lock);
+	shared = block_ref(group, blocknum);
+	pthread_mutex_unlock(&group->lock);
+	return shared;
 }
 
-int determine_block(int inumber, int offset){
-    int block_num; 
-    if(offset >= 4214784){
-        return  -1; 
-    }
-    block_num = offset / 4096; 
-    return block_num; 
+// drop the references share_block took to the first n of blocks
+static void unshare_blocks(struct fs *fs, const int *blocks, int n){
+	int i;
+	for( i = 0; i < n; i++ ){
+		if( blocks[i] != 0 ){
+			release_inumber(fs, blocks[i]);
+		}
+	}
 }
 
-int get_NEXT_AVAILABLE(){
+/*
+True if the caller holds the only reference to the block and may change it
+in place. The block leaves the dedup index first, so nobody can start
+sharing it while it is being rewritten.
+*/
+static int own_block(struct fs *fs, int blocknum){
+	struct fs_group *group = block_group(fs, blocknum);
+	int mine;
+	pthread_mutex_lock(&group->lock);
+	mine = block_refs(group, blocknum) == 1;
+	if( mine ){
+		dedup_remove(fs, blocknum);
+	}
+	pthread_mutex_unlock(&group->lock);
+	return mine;
+}
+
+// CRC-32; lookups compare the bytes too, so collisions only cost a read
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+	uint32_t c;
+	int i, k;
+	for( i = 0; i < 256; i++ ){
+		c = i;
+		for( k = 0; k < 8; k++ ){
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t hash_block(const char *data, int length){
+	uint32_t c = 0xffffffff;
 	int i;
-	for ( i = 1; i < NBLOCKS; i++ ){
-		if( NEXT_AVAILABLE[i] == 0 ){
-			NEXT_AVAILABLE[i] = 1;
-			return i;
+	pthread_once(&crc_once, crc_init);
+	for( i = 0; i < length; i++ ){
+		c = crc_table[(c ^ (unsigned char)data[i]) & 0xff] ^ (c >> 8);
+	}
+	c = ~c;
+	return c == DEDUP_NONE ? 1 : c;
+}
+
+/*
+Find a block holding exactly data and take a reference to it. Returns 0
+if there is none. The reference keeps the owner from rewriting the block
+in place while its contents are checked.
+*/
+static int dedup_lookup(struct fs *fs, uint32_t hash, const char *data){
+	union fs_block block;
+	struct fs_group *group;
+	int b;
+
+	pthread_mutex_lock(&fs->dedup_lock);
+	for( b = fs->hash_heads[hash & (fs->nbuckets - 1)]; b != 0; b = fs->hash_next[b] ){
+		if( fs->block_hash[b] == hash ){
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fs->dedup_lock);
+	if( b == 0 ){
+		return 0;
+	}
+
+	// the group lock comes first, so look again whether the block is still indexed
+	group = block_group(fs, b);
+	pthread_mutex_lock(&group->lock);
+	pthread_mutex_lock(&fs->dedup_lock);
+	if( fs->block_hash[b] != hash || block_refs(group, b) == 0 || !block_ref(group, b) ){
+		b = 0; // gone from the index, or no memory to count the reference
+	}
+	pthread_mutex_unlock(&fs->dedup_lock);
+	pthread_mutex_unlock(&group->lock);
+	if( b == 0 ){
+		return 0;
+	}
+
+	disk_read(fs->disk, b, block.data);
+	if( memcmp(block.data, data, fs->blocksize) != 0 ){
+		release_inumber(fs, b);
+		return 0;
+	}
+	__sync_fetch_and_add(&fs->dedup_saved, 1);
+	return b;
+}
+
+static void dedup_insert(struct fs *fs, int blocknum, uint32_t hash){
+	struct fs_group *group = block_group(fs, blocknum);
+	int bucket = hash & (fs->nbuckets - 1);
+	int b;
+
+	pthread_mutex_lock(&group->lock);
+	pthread_mutex_lock(&fs->dedup_lock);
+	for( b = fs->hash_heads[bucket]; b != 0; b = fs->hash_next[b] ){
+		if( fs->block_hash[b] == hash ){
+			break;
+		}
+	}
+	// the first block seen with a hash stays the one that is shared
+	if( b == 0 && fs->block_hash[blocknum] == DEDUP_NONE && block_refs(group, blocknum) > 0 ){
+		fs->block_hash[blocknum] = hash;
+		fs->hash_next[blocknum] = fs->hash_heads[bucket];
+		fs->hash_heads[bucket] = blocknum;
+	}
+	pthread_mutex_unlock(&fs->dedup_lock);
+	pthread_mutex_unlock(&group->lock);
+}
+
+// caller holds the lock of the block's group
+static void dedup_remove(struct fs *fs, int blocknum){
+	int *link;
+
+	if( !fs->hashblocks ){
+		return;
+	}
+	pthread_mutex_lock(&fs->dedup_lock);
+	if( fs->block_hash[blocknum] == DEDUP_NONE ){
+		pthread_mutex_unlock(&fs->dedup_lock);
+		return;
+	}
+	link = &fs->hash_heads[fs->block_hash[blocknum] & (fs->nbuckets - 1)];
+	while( *link != blocknum ){
+		link = &fs->hash_next[*link];
+	}
+	*link = fs->hash_next[blocknum];
+	fs->hash_next[blocknum] = 0;
+	fs->block_hash[blocknum] = DEDUP_NONE;
+	pthread_mutex_unlock(&fs->dedup_lock);
+}
+
+// read the saved index back; hashes of blocks no longer in use are dropped
+static void load_hashes(struct fs *fs){
+	union fs_block block;
+	uint32_t hash;
+	int per_block = fs->blocksize / sizeof(uint32_t);
+	int i, b;
+
+	fs->dedup_saved = 0;
+	if( !fs->hashblocks ){
+		return;
+	}
+	fs->block_hash = (uint32_t *)calloc(fs->nblocks, sizeof(uint32_t));
+	fs->hash_next = (int *)calloc(fs->nblocks, sizeof(int));
+	for( fs->nbuckets = 1; fs->nbuckets < fs->nblocks; fs->nbuckets <<= 1 );
+	fs->hash_heads = (int *)calloc(fs->nbuckets, sizeof(int));
+
+	for( i = 0; i < fs->hashblocks; i++ ){
+		disk_read(fs->disk, fs->first_data_block - fs->hashblocks + i, block.data);
+		for( b = i * per_block; b < (i + 1) * per_block && b < fs->nblocks; b++ ){
+			hash = ((uint32_t *)block.data)[b - i * per_block];
+			if( hash != DEDUP_NONE && b >= fs->first_data_block ){
+				dedup_insert(fs, b, hash);
+			}
 		}
 	}
+}
+
+/*
+Record the free counts in the superblock at unmount, or at mount that
+they are about to go stale, so a crash never leaves wrong ones behind.
+*/
+static void store_counts(struct fs *fs, int known){
+	union fs_block block;
+	struct fs_stats stats;
+
+	disk_read(fs->disk, 0, block.data);
+	if( known && fs_statfs(fs, &stats) ){
+		block.super.free_blocks = stats.free_blocks + 1;
+		block.super.free_inodes = stats.free_inodes + 1;
+	} else if( block.super.free_blocks == 0 && block.super.free_inodes == 0 ){
+		return; // already unknown
+	} else {
+		block.super.free_blocks = 0;
+		block.super.free_inodes = 0;
+	}
+	disk_write(fs->disk, 0, block.data);
+}
+
+static void store_hashes(struct fs *fs){
+	union fs_block block;
+	int per_block = fs->blocksize / sizeof(uint32_t);
+	int i, n;
+
+	for( i = 0; i < fs->hashblocks; i++ ){
+		memset(block.data, 0, fs->blocksize);
+		n = fs->nblocks - i * per_block < per_block ? fs->nblocks - i * per_block : per_block;
+		memcpy(block.data, &fs->block_hash[i * per_block], n * sizeof(uint32_t));
+		disk_write(fs->disk, fs->first_data_block - fs->hashblocks + i, block.data);
+	}
+}
 
-	printf("Error: The disk is full.\n");
-	return -1; // completely full
+/*
+Dedup effect since format: how many block references the files hold, how
+many distinct data blocks back them, and how many block writes were
+skipped since mount because the data was already on disk.
+*/
+int fs_dedup_stats( struct fs *fs, int *logical, int *physical, int *saved )
+{
+	int i, g;
+	if( !fs->mounted ){
+		fprintf(stderr, "File system not mounted\n");
+		return 0;
+	}
+	*logical = 0;
+	*physical = 0;
+	for( g = 0; g < fs->ngroups; g++ ){
+		struct fs_group *group = &fs->groups[g];
+		pthread_mutex_lock(&group->lock);
+		*physical += group->end_block - group->first_block - group->free_blocks;
+		*logical += group->end_block - group->first_block - group->free_blocks;
+		for( i = 0; i < group->shared.size; i++ ){
+			if( group->shared.keys[i] != 0 ){
+				*logical += group->shared.values[i];
+			}
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+	*saved = fs->dedup_saved;
+	return 1;
 }
 
-void release_inumber(int inumber){
-	NEXT_AVAILABLE[inumber] = 0;
+static void release_tables(struct fs *fs){
+	int g;
+	for( g = 0; g < fs->ngroups; g++ ){
+		pthread_mutex_destroy(&fs->groups[g].lock);
+		extent_destroy(fs->groups[g].extents);
+		intmap_free(&fs->groups[g].shared);
+		intmap_free(&fs->groups[g].windows);
+		free(fs->groups[g].used);
+		free(fs->groups[g].free_slot_map);
+	}
+	free(fs->groups);
+	fs->groups = 0;
+	fs->ngroups = 0;
+	intmap_free(&fs->file_windows);
+	free(fs->orphans);
+	fs->orphans = 0;
+	fs->norphans = 0;
+	free(fs->block_hash);
+	free(fs->hash_next);
+	free(fs->hash_heads);
+	fs->block_hash = 0;
+	fs->hash_next = 0;
+	fs->hash_heads = 0;
+	fs->hashblocks = 0;
 }
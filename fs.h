@@ -1,15 +1,65 @@
 #ifndef FS_H
 #define FS_H
 
-void fs_debug();
-int  fs_format();
-int  fs_mount();
+#include "disk.h"
 
-int  fs_create();
-int  fs_delete( int inumber );
-int  fs_getsize();
+// longest file name, not counting the terminating null
+#define FS_NAME_MAX 27
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+struct fs;
+
+// what fs_statfs reports; blocks are data blocks, not counting the superblock and tables
+struct fs_stats {
+	int blocksize;
+	int total_blocks;
+	int free_blocks;
+	int total_inodes;
+	int free_inodes;
+	int files;		// inodes in use by files, including the directory
+};
+
+// one file block's worth of a range returned by fs_pin; read-only, valid until fs_unpin.
+// The refs own their memory and do not point into the image, so fs_unpin ignores its fs.
+struct fs_blockref {
+	const char *data;
+	int offset;		// file offset of data[0]
+	int length;
+};
+
+struct fs * fs_init( struct disk *d );
+void fs_close( struct fs *fs );
+
+void fs_debug( struct fs *fs );
+int  fs_fsck( struct fs *fs, int repair );
+int  fs_format( struct fs *fs, int blocksize, int inodesize, int dedup );
+int  fs_mount( struct fs *fs );
+int  fs_unmount( struct fs *fs );
+int  fs_statfs( struct fs *fs, struct fs_stats *stats );
+
+int  fs_create( struct fs *fs );
+int  fs_create_n( struct fs *fs, int *inumbers, int n );
+int  fs_delete_n( struct fs *fs, const int *inumbers, int n );
+int  fs_sync( struct fs *fs );
+int  fs_clone( struct fs *fs, int inumber );
+int  fs_compress( struct fs *fs, int inumber );
+int  fs_delete( struct fs *fs, int inumber );
+int  fs_getsize( struct fs *fs, int inumber );
+
+int  fs_create_named( struct fs *fs, const char *name );
+int  fs_lookup( struct fs *fs, const char *name );
+int  fs_unlink( struct fs *fs, const char *name );
+
+int  fs_read( struct fs *fs, int inumber, char *data, int length, int offset );
+int  fs_write( struct fs *fs, int inumber, const char *data, int length, int offset );
+int  fs_readv( struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset );
+int  fs_writev( struct fs *fs, int inumber, const struct iovec *iov, int iovcnt, int offset );
+int  fs_pin( struct fs *fs, int inumber, int offset, int length, struct fs_blockref **refs );
+void fs_unpin( struct fs *fs, struct fs_blockref *refs );
+int  fs_scan( struct fs *fs, int inumber, int (*fn)( void *arg, const char *data, int length, int offset ), void *arg );
+int  fs_truncate( struct fs *fs, int inumber, int size );
+int  fs_fallocate( struct fs *fs, int inumber, int size );
+int  fs_fragments( struct fs *fs, int inumber );
+int  fs_defrag( struct fs *fs, int budget );
+int  fs_dedup_stats( struct fs *fs, int *logical, int *physical, int *saved );
 
 #endif
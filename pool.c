@@ -0,0 +1,144 @@
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct pool_job {
+	void (*fn)( void *arg, int index );
+	void *arg;
+	int count;
+	int next;
+	int finished;
+	struct pool_job *link;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct pool_job *head;
+	struct pool_job *tail;
+	pthread_t *threads;
+	int nthreads;
+	int shutdown;
+};
+
+/* Called with the lock held. */
+static void dequeue( struct pool *p, struct pool_job *job )
+{
+	struct pool_job **j, *prev=0;
+
+	for(j=&p->head;*j;prev=*j,j=&(*j)->link) {
+		if(*j==job) {
+			*j = job->link;
+			if(p->tail==job) p->tail = prev;
+			return;
+		}
+	}
+}
+
+/* Called with the lock held; runs one index of job and returns with the lock held. */
+static void step( struct pool *p, struct pool_job *job )
+{
+	int index = job->next++;
+	if(job->next==job->count) dequeue(p,job);
+
+	pthread_mutex_unlock(&p->lock);
+	job->fn(job->arg,index);
+	pthread_mutex_lock(&p->lock);
+
+	if(++job->finished==job->count) pthread_cond_broadcast(&p->done);
+}
+
+static void * worker( void *arg )
+{
+	struct pool *p = arg;
+
+	pthread_mutex_lock(&p->lock);
+	while(1) {
+		while(!p->head && !p->shutdown) pthread_cond_wait(&p->work,&p->lock);
+		if(!p->head) break;
+		step(p,p->head);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return 0;
+}
+
+struct pool * pool_create( int nthreads )
+{
+	struct pool *p = calloc(1,sizeof(struct pool));
+	int i;
+
+	if(!p) return 0;
+
+	p->threads = calloc(nthreads,sizeof(pthread_t));
+	if(!p->threads) {
+		free(p);
+		return 0;
+	}
+
+	pthread_mutex_init(&p->lock,0);
+	pthread_cond_init(&p->work,0);
+	pthread_cond_init(&p->done,0);
+
+	for(i=0;i<nthreads;i++) {
+		if(pthread_create(&p->threads[i],0,worker,p)) break;
+	}
+	p->nthreads = i;
+
+	return p;
+}
+
+void pool_run( struct pool *p, void (*fn)( void *arg, int index ), void *arg, int count )
+{
+	struct pool_job job;
+
+	if(count<=0) return;
+
+	job.fn = fn;
+	job.arg = arg;
+	job.count = count;
+	job.next = 0;
+	job.finished = 0;
+	job.link = 0;
+
+	pthread_mutex_lock(&p->lock);
+
+	if(p->tail) {
+		p->tail->link = &job;
+	} else {
+		p->head = &job;
+	}
+	p->tail = &job;
+	pthread_cond_broadcast(&p->work);
+
+	// the caller helps with its own job rather than sitting idle
+	while(job.next<job.count) step(p,&job);
+	while(job.finished<job.count) pthread_cond_wait(&p->done,&p->lock);
+
+	pthread_mutex_unlock(&p->lock);
+}
+
+void pool_destroy( struct pool *p )
+{
+	int i;
+
+	if(!p) return;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for(i=0;i<p->nthreads;i++) {
+		pthread_join(p->threads[i],0);
+	}
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->work);
+	pthread_cond_destroy(&p->done);
+	free(p->threads);
+	free(p);
+}
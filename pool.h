@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+A fixed set of worker threads that run parallel loops. pool_run calls
+fn(arg,i) for every i in [0,count) spread over the workers and the
+calling thread, and returns once all of them have finished. Any number
+of threads may call pool_run on the same pool at once.
+*/
+
+struct pool;
+
+struct pool * pool_create( int nthreads );
+void pool_run( struct pool *p, void (*fn)( void *arg, int index ), void *arg, int count );
+void pool_destroy( struct pool *p );
+
+#endif
@@ -6,9 +6,13 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
 
-static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
+static int do_copyin( struct fs *fs, const char *filename, int inumber );
+static int do_copyout( struct fs *fs, int inumber, const char *filename );
+static int do_bench( struct fs *fs, struct disk *disk, const char *name, int n );
+static double now_seconds();
 
 int main( int argc, char *argv[] )
 {
@@ -16,19 +20,31 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
+	char arg3[1024];
+	int logical, physical, saved;
 	int inumber, result, args;
+	struct disk *disk;
+	struct fs *fs;
 
 	if(argc!=3) {
 		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	disk = disk_init(argv[1],atoi(argv[2]));
+	if(!disk) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	fs = fs_init(disk);
+	if(!fs) {
+		printf("couldn't allocate filesystem: %s\n",strerror(errno));
+		disk_close(disk);
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size(disk));
 
 	while(1) {
 		printf(" simplefs> ");
@@ -39,22 +55,35 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			if((args>=1 && args<=3) || (args==4 && !strcmp(arg3,"dedup"))) {
+				if(fs_format(fs,args>=2 ? atoi(arg1) : 0,args>=3 ? atoi(arg2) : 0,args==4)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [blocksize] [inodesize] [dedup]\n");
+			}
+		} else if(!strcmp(cmd,"fsck")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+				double start = now_seconds();
+				result = fs_fsck(fs,args==2);
+				if(result<0) {
+					printf("fsck failed!\n");
+				} else {
+					printf("fsck: %d problems found%s in %.3f s\n",result,
+						result && args==2 ? " and repaired" : "",now_seconds()-start);
+				}
+			} else {
+				printf("use: fsck [repair]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
-				if(fs_mount()) {
+				if(fs_mount(fs)) {
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
@@ -64,14 +93,37 @@ int main( int argc, char *argv[] )
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
-				fs_debug();
+				fs_debug(fs);
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"statfs")) {
+			if(args==1) {
+				struct fs_stats stats;
+				if(fs_statfs(fs,&stats)) {
+					printf("%d blocks of %d bytes, %d free (%.1f%%)\n",stats.total_blocks,stats.blocksize,
+						stats.free_blocks,100.0*stats.free_blocks/stats.total_blocks);
+					printf("%d inodes, %d free, %d files\n",stats.total_inodes,stats.free_inodes,stats.files);
+				} else {
+					printf("statfs failed!\n");
+				}
+			} else {
+				printf("use: statfs\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync(fs)) {
+					printf("deleted files freed.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
+				result = fs_getsize(fs,inumber);
 				if(result>=0) {
 					printf("inode %d has size %d\n",inumber,result);
 				} else {
@@ -82,20 +134,64 @@ int main( int argc, char *argv[] )
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
+			if(args==1 || args==2) {
+				inumber = args==2 ? fs_create_named(fs,arg1) : fs_create(fs);
 				if(inumber>0) {
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
 				}
 			} else {
-				printf("use: create\n");
+				printf("use: create [name]\n");
+			}
+		} else if(!strcmp(cmd,"lookup")) {
+			if(args==2) {
+				inumber = fs_lookup(fs,arg1);
+				if(inumber>0) {
+					printf("%s is inode %d\n",arg1,inumber);
+				} else {
+					printf("%s not found\n",arg1);
+				}
+			} else {
+				printf("use: lookup <name>\n");
+			}
+		} else if(!strcmp(cmd,"unlink")) {
+			if(args==2) {
+				if(fs_unlink(fs,arg1)) {
+					printf("%s unlinked.\n",arg1);
+				} else {
+					printf("unlink failed!\n");
+				}
+			} else {
+				printf("use: unlink <name>\n");
+			}
+		} else if(!strcmp(cmd,"clone")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				result = fs_clone(fs,inumber);
+				if(result>0) {
+					printf("cloned inode %d to inode %d\n",inumber,result);
+				} else {
+					printf("clone failed!\n");
+				}
+			} else {
+				printf("use: clone <inumber>\n");
+			}
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(fs_compress(fs,inumber)) {
+					printf("inode %d is now compressed.\n",inumber);
+				} else {
+					printf("compress failed!\n");
+				}
+			} else {
+				printf("use: compress <inumber>\n");
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
+				if(fs_delete(fs,inumber)) {
 					printf("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
@@ -103,10 +199,32 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: delete <inumber>\n");
 			}
+		} else if(!strcmp(cmd,"truncate")) {
+			if(args==3) {
+				inumber = atoi(arg1);
+				if(fs_truncate(fs,inumber,atoi(arg2))) {
+					printf("inode %d truncated to %d bytes.\n",inumber,atoi(arg2));
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <inumber> <size>\n");
+			}
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==3) {
+				inumber = atoi(arg1);
+				if(fs_fallocate(fs,inumber,atoi(arg2))) {
+					printf("inode %d has space for %d bytes.\n",inumber,atoi(arg2));
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <inumber> <size>\n");
+			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
+				if(!do_copyout(fs,inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
 				}
 			} else {
@@ -116,7 +234,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"copyin")) {
 			if(args==3) {
 				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
+				if(do_copyin(fs,arg1,inumber)) {
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
@@ -128,7 +246,7 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"copyout")) {
 			if(args==3) {
 				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
+				if(do_copyout(fs,inumber,arg2)) {
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
@@ -137,16 +255,77 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"fragments")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				result = fs_fragments(fs,inumber);
+				if(result>=0) {
+					printf("inode %d is in %d runs of blocks\n",inumber,result);
+				} else {
+					printf("fragments failed!\n");
+				}
+			} else {
+				printf("use: fragments <inumber>\n");
+			}
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==2) {
+				printf("moved %d blocks\n",fs_defrag(fs,atoi(arg1)));
+			} else {
+				printf("use: defrag <budget>\n");
+			}
+		} else if(!strcmp(cmd,"dedup")) {
+			if(args==1) {
+				if(fs_dedup_stats(fs,&logical,&physical,&saved)) {
+					printf("%d block references in %d blocks, dedup ratio %.2f\n",logical,physical,physical ? (double)logical/physical : 1.0);
+					printf("%d block writes saved since mount\n",saved);
+				} else {
+					printf("dedup failed!\n");
+				}
+			} else {
+				printf("use: dedup\n");
+			}
+
+		} else if(!strcmp(cmd,"bench")) {
+			if(args==3) {
+				if(!do_bench(fs,disk,arg1,atoi(arg2))) {
+					printf("bench failed!\n");
+				}
+			} else {
+				printf("use: bench <name> <n>\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [blocksize] [inodesize] [dedup]\n");
+			printf("    fsck    [repair]\n");
 			printf("    mount\n");
 			printf("    debug\n");
-			printf("    create\n");
+			printf("    statfs\n");
+			printf("    sync\n");
+			printf("    create  [name]\n");
+			printf("    lookup  <name>\n");
+			printf("    unlink  <name>\n");
+			printf("    clone   <inode>\n");
+			printf("    compress <inode>\n");
 			printf("    delete  <inode>\n");
+			printf("    truncate  <inode> <size>\n");
+			printf("    fallocate <inode> <size>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    fragments <inode>\n");
+			printf("    defrag  <budget>\n");
+			printf("    dedup\n");
+			printf("    bench   churn <ops>\n");
+			printf("    bench   stress <maxthreads>\n");
+			printf("    bench   read <kbytes>\n");
+			printf("    bench   compress <kbytes>\n");
+			printf("    bench   names <count>\n");
+			printf("    bench   interleave <files>\n");
+			printf("    bench   gather <records>\n");
+			printf("    bench   scan <kbytes>\n");
+			printf("    bench   batch <files>\n");
+			printf("    bench   full <blocks>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -162,12 +341,13 @@ int main( int argc, char *argv[] )
 	}
 
 	printf("closing emulated disk.\n");
-	disk_close();
+	fs_close(fs);
+	disk_close(disk);
 
 	return 0;
 }
 
-static int do_copyin( const char *filename, int inumber )
+static int do_copyin( struct fs *fs, const char *filename, int inumber )
 {
 	FILE *file;
 	int offset=0, result, actual;
@@ -183,7 +363,7 @@ static int do_copyin( const char *filename, int inumber )
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_write(fs,inumber,buffer,result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
 				break;
@@ -202,7 +382,7 @@ static int do_copyin( const char *filename, int inumber )
 	return 1;
 }
 
-static int do_copyout( int inumber, const char *filename )
+static int do_copyout( struct fs *fs, int inumber, const char *filename )
 {
 	FILE *file;
 	int offset=0, result;
@@ -215,7 +395,7 @@ static int do_copyout( int inumber, const char *filename )
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_read(fs,inumber,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
@@ -227,3 +407,703 @@ static int do_copyout( int inumber, const char *filename )
 	return 1;
 }
 
+
+static double now_seconds()
+{
+	struct timeval tv;
+	gettimeofday(&tv,0);
+	return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+/*
+Fill the inode table, reporting the create rate of each tenth of the fill,
+then run nops delete/create pairs against the full table, then delete
+everything the benchmark created.
+*/
+
+static int do_bench_churn( struct fs *fs, struct disk *disk, int nops )
+{
+	int *inodes=0, *marks=0;
+	double *times=0;
+	int n=0, capacity=0, nmarks=0, i, j, victim, inumber;
+	int reads, writes;
+	double start, elapsed;
+
+	reads = disk_nreads(disk);
+	writes = disk_nwrites(disk);
+	start = now_seconds();
+	while(1) {
+		if(n==capacity) {
+			capacity = capacity ? capacity*2 : 1024;
+			inodes = realloc(inodes,sizeof(int)*capacity);
+			marks = realloc(marks,sizeof(int)*(capacity/1024+1));
+			times = realloc(times,sizeof(double)*(capacity/1024+1));
+		}
+		if(n%1024==0) {
+			marks[nmarks] = n;
+			times[nmarks] = now_seconds();
+			nmarks++;
+		}
+		inumber = fs_create(fs);
+		if(inumber<=0) break;
+		inodes[n++] = inumber;
+	}
+	marks[nmarks] = n;
+	times[nmarks] = now_seconds();
+
+	if(n==0) {
+		printf("no inodes could be created\n");
+		free(inodes); free(marks); free(times);
+		return 0;
+	}
+
+	printf("filled %d inodes in %.3f s, %d reads, %d writes\n",n,times[nmarks]-start,
+		disk_nreads(disk)-reads,disk_nwrites(disk)-writes);
+	for(i=0;i<10;i++) {
+		int lo = (nmarks*i)/10;
+		int hi = (nmarks*(i+1))/10;
+		if(hi<=lo) continue;
+		printf("    %3d%%-%3d%% full: %.0f creates/s\n",i*10,(i+1)*10,
+			(marks[hi]-marks[lo])/(times[hi]-times[lo]+1e-9));
+	}
+
+	reads = disk_nreads(disk);
+	writes = disk_nwrites(disk);
+	srand(1);
+	start = now_seconds();
+	for(i=0;i<nops;i+=2) {
+		j = rand()%n;
+		victim = inodes[j];
+		if(!fs_delete(fs,victim)) break;
+		inumber = fs_create(fs);
+		if(inumber<=0) break;
+		inodes[j] = inumber;
+	}
+	fs_sync(fs);
+	elapsed = now_seconds()-start;
+	printf("churn: %d ops in %.3f s (%.0f ops/s), %d reads, %d writes\n",
+		i,elapsed,i/(elapsed+1e-9),disk_nreads(disk)-reads,disk_nwrites(disk)-writes);
+
+	for(i=0;i<n;i++) {
+		fs_delete(fs,inodes[i]);
+	}
+
+	free(inodes);
+	free(marks);
+	free(times);
+	return 1;
+}
+
+#define STRESS_OPS 20000
+
+struct stress_args {
+	struct fs *fs;
+	int shared;
+	int id;
+	int nops;
+	int errors;
+};
+
+/*
+Each op creates a private file, writes it, reads it back and checks it,
+reads the shared file, then deletes the private file.
+*/
+
+static void * stress_thread( void *arg )
+{
+	struct stress_args *a = arg;
+	char out[2000], in[2000];
+	int i, inumber, length;
+	unsigned seed = a->id+1;
+
+	for(i=0;i<a->nops;i++) {
+		length = 1 + rand_r(&seed)%sizeof(out);
+		memset(out,'a'+(a->id+i)%26,length);
+		inumber = fs_create(a->fs);
+		if(inumber<=0) {
+			a->errors++;
+			continue;
+		}
+		if(fs_write(a->fs,inumber,out,length,0)!=length) {
+			a->errors++;
+		} else if(fs_read(a->fs,inumber,in,length,0)!=length || memcmp(in,out,length)) {
+			a->errors++;
+		}
+		if(fs_read(a->fs,a->shared,in,sizeof(in),0)!=sizeof(in)) {
+			a->errors++;
+		}
+		fs_delete(a->fs,inumber);
+	}
+	return 0;
+}
+
+static int do_bench_stress( struct fs *fs, int maxthreads )
+{
+	pthread_t threads[256];
+	struct stress_args args[256];
+	char buffer[2000];
+	int nthreads, i, errors, shared;
+	double start, elapsed, base=0;
+
+	if(maxthreads<1 || maxthreads>256) {
+		printf("thread count must be between 1 and 256\n");
+		return 0;
+	}
+
+	shared = fs_create(fs);
+	if(shared<=0) return 0;
+	memset(buffer,'s',sizeof(buffer));
+	fs_write(fs,shared,buffer,sizeof(buffer),0);
+
+	for(nthreads=1;nthreads<=maxthreads;nthreads*=2) {
+		start = now_seconds();
+		for(i=0;i<nthreads;i++) {
+			args[i].fs = fs;
+			args[i].shared = shared;
+			args[i].id = i;
+			args[i].nops = STRESS_OPS/nthreads;
+			args[i].errors = 0;
+			pthread_create(&threads[i],0,stress_thread,&args[i]);
+		}
+		errors = 0;
+		for(i=0;i<nthreads;i++) {
+			pthread_join(threads[i],0);
+			errors += args[i].errors;
+		}
+		fs_sync(fs);
+		elapsed = now_seconds()-start;
+		if(nthreads==1) base = STRESS_OPS/elapsed;
+		printf("%3d threads: %.0f ops/s (%.2fx), %d errors\n",nthreads,
+			(STRESS_OPS/nthreads)*nthreads/elapsed,
+			(STRESS_OPS/nthreads)*nthreads/elapsed/base,errors);
+		if(nthreads<maxthreads && nthreads*2>maxthreads) nthreads = maxthreads/2;
+	}
+
+	fs_delete(fs,shared);
+	return 1;
+}
+
+#define READ_ROUNDS 20
+#define READ_CHUNK 32768
+
+/*
+Write a file of the given size, then time reading it back whole in one
+fs_read call against reading it in chunks too small to be parallelized.
+*/
+
+static int do_bench_read( struct fs *fs, int kbytes )
+{
+	int length = kbytes*1024, inumber, i, offset, result, ok=1;
+	char *out, *in;
+	double start, whole, chunked;
+
+	if(length<=0) return 0;
+
+	out = malloc(length);
+	in = malloc(length);
+	inumber = fs_create(fs);
+	if(!out || !in || inumber<=0) {
+		free(out); free(in);
+		return 0;
+	}
+
+	for(i=0;i<length;i++) out[i] = rand();
+	length = fs_write(fs,inumber,out,length,0);
+	if(length<=0) {
+		fs_delete(fs,inumber);
+		free(out); free(in);
+		return 0;
+	}
+
+	start = now_seconds();
+	for(i=0;i<READ_ROUNDS;i++) {
+		if(fs_read(fs,inumber,in,length,0)!=length || memcmp(in,out,length)) ok = 0;
+	}
+	whole = now_seconds()-start;
+
+	start = now_seconds();
+	for(i=0;i<READ_ROUNDS;i++) {
+		for(offset=0;offset<length;offset+=result) {
+			result = fs_read(fs,inumber,in+offset,READ_CHUNK,offset);
+			if(result<=0) break;
+		}
+		if(offset!=length || memcmp(in,out,length)) ok = 0;
+	}
+	chunked = now_seconds()-start;
+
+	printf("%d bytes: whole-file reads %.1f MB/s, %d-byte reads %.1f MB/s%s\n",length,
+		READ_ROUNDS*(double)length/whole/1e6,READ_CHUNK,
+		READ_ROUNDS*(double)length/chunked/1e6,ok ? "" : ", DATA MISMATCH");
+
+	fs_delete(fs,inumber);
+	free(out);
+	free(in);
+	return ok;
+}
+
+static unsigned scan_sum;
+
+static int sum_block( void *arg, const char *data, int length, int offset )
+{
+	int i;
+	for(i=0;i<length;i++) scan_sum = scan_sum*31+(unsigned char)data[i];
+	return 0;
+}
+
+/*
+Checksum a file of the given size by copying it out with fs_read, a
+chunk at a time, and in place with fs_scan.
+*/
+
+static int do_bench_scan( struct fs *fs, int kbytes )
+{
+	int length = kbytes*1024, inumber, i, offset, result;
+	unsigned copied;
+	char *out, *in;
+	double start, copy, scan;
+
+	if(length<=0) return 0;
+
+	out = malloc(length);
+	in = malloc(READ_CHUNK);
+	inumber = fs_create(fs);
+	if(!out || !in || inumber<=0) {
+		free(out); free(in);
+		return 0;
+	}
+
+	for(i=0;i<length;i++) out[i] = rand();
+	length = fs_write(fs,inumber,out,length,0);
+	if(length<=0) {
+		fs_delete(fs,inumber);
+		free(out); free(in);
+		return 0;
+	}
+
+	start = now_seconds();
+	scan_sum = 0;
+	for(offset=0;offset<length;offset+=result) {
+		result = fs_read(fs,inumber,in,READ_CHUNK,offset);
+		if(result<=0) break;
+		sum_block(0,in,result,offset);
+	}
+	copy = now_seconds()-start;
+	copied = scan_sum;
+
+	start = now_seconds();
+	scan_sum = 0;
+	result = fs_scan(fs,inumber,sum_block,0);
+	scan = now_seconds()-start;
+
+	printf("%d bytes: fs_read checksum %.1f MB/s, fs_scan checksum %.1f MB/s%s\n",length,
+		(double)length/copy/1e6,(double)length/scan/1e6,
+		result==length && scan_sum==copied ? "" : ", DATA MISMATCH");
+
+	fs_delete(fs,inumber);
+	free(out);
+	free(in);
+	return result==length && scan_sum==copied;
+}
+
+/*
+Store the same kbytes of generated English-like text in a plain file and
+in a compressed one, and compare the blocks each takes and the disk
+reads and time needed to read it back.
+*/
+
+static int do_bench_compress( struct fs *fs, struct disk *disk, int kbytes )
+{
+	static const char *words[] = { "the", "file", "system", "block", "inode", "of", "and",
+		"to", "a", "disk", "is", "in", "data", "write", "read", "that", "for", "size" };
+	int length = kbytes*1024, i, k, pass, inumber, ok=1;
+	int logical, physical, saved, before, reads;
+	char *out, *in;
+	double start;
+
+	if(length<=0) return 0;
+
+	out = malloc(length);
+	in = malloc(length);
+	if(!out || !in) {
+		free(out); free(in);
+		return 0;
+	}
+	srand(1);
+	for(i=0;i<length;) {
+		const char *w = words[rand()%(sizeof(words)/sizeof(words[0]))];
+		for(k=0;w[k] && i<length;k++) out[i++] = w[k];
+		if(i<length) out[i++] = rand()%12 ? ' ' : '\n';
+	}
+
+	for(pass=0;pass<2;pass++) {
+		inumber = fs_create(fs);
+		if(inumber<=0 || (pass && !fs_compress(fs,inumber))) {
+			ok = 0;
+			break;
+		}
+		fs_dedup_stats(fs,&logical,&before,&saved);
+		if(fs_write(fs,inumber,out,length,0)!=length) ok = 0;
+		fs_dedup_stats(fs,&logical,&physical,&saved);
+
+		reads = disk_nreads(disk);
+		start = now_seconds();
+		if(fs_read(fs,inumber,in,length,0)!=length || memcmp(in,out,length)) ok = 0;
+		printf("%-10s %d bytes in %d blocks, %d disk reads to read back (%.0f bytes per read), %.1f MB/s\n",
+			pass ? "compressed" : "plain",length,physical-before,disk_nreads(disk)-reads,
+			(double)length/(disk_nreads(disk)-reads),length/(now_seconds()-start)/1e6);
+		fs_delete(fs,inumber);
+		fs_sync(fs);
+	}
+	if(!ok) printf("DATA MISMATCH\n");
+
+	free(out);
+	free(in);
+	return ok;
+}
+
+/*
+Create n named files, look every one of them up, then unlink them all,
+reporting the rate and disk reads per operation of each phase.
+*/
+
+static int do_bench_names( struct fs *fs, struct disk *disk, int n )
+{
+	char name[32];
+	int phase, done, reads, ok=1;
+	double start, elapsed;
+	static const char *phases[] = { "create", "lookup", "unlink" };
+
+	for(phase=0;phase<3;phase++) {
+		reads = disk_nreads(disk);
+		start = now_seconds();
+		for(done=0;done<n;done++) {
+			snprintf(name,sizeof(name),"file%d",done);
+			if(phase==0 && fs_create_named(fs,name)<=0) break;
+			if(phase==1 && fs_lookup(fs,name)<=0) break;
+			if(phase==2 && !fs_unlink(fs,name)) break;
+		}
+		elapsed = now_seconds()-start;
+		printf("%s: %d names in %.3f s (%.0f/s), %.1f reads each\n",phases[phase],done,elapsed,
+			done/(elapsed+1e-9),done ? (double)(disk_nreads(disk)-reads)/done : 0.0);
+		if(done<n) {
+			ok = 0;
+			n = done;
+		}
+	}
+	return ok;
+}
+
+#define INTERLEAVE_BLOCKS 64
+#define SEEK_SECONDS 0.008
+#define TRANSFER_RATE 100e6
+
+/*
+Grow n files together, one block at a time in turn, as concurrent
+appenders would, then read each back in order. Throughput is modeled on
+a rotating disk: every seek costs SEEK_SECONDS and the data moves at
+TRANSFER_RATE.
+*/
+
+static int do_bench_interleave( struct fs *fs, struct disk *disk, int n )
+{
+	int *inumbers, i, f, blocksize = disk_blocksize(disk), length, offset, result;
+	int seeks, reads, fragments = 0, ok = 1;
+	char *out, *in;
+	double modeled;
+
+	if(n<=0) return 0;
+	length = INTERLEAVE_BLOCKS*blocksize;
+	inumbers = malloc(sizeof(int)*n);
+	out = malloc(blocksize);
+	in = malloc(READ_CHUNK);
+	if(!inumbers || !out || !in) {
+		free(inumbers); free(out); free(in);
+		return 0;
+	}
+
+	for(f=0;f<n;f++) {
+		inumbers[f] = fs_create(fs);
+		if(inumbers[f]<=0) {
+			n = f;
+			ok = 0;
+			break;
+		}
+	}
+	for(i=0;i<INTERLEAVE_BLOCKS && ok;i++) {
+		for(f=0;f<n;f++) {
+			memset(out,f+i,blocksize);
+			if(fs_write(fs,inumbers[f],out,blocksize,i*blocksize)!=blocksize) ok = 0;
+		}
+	}
+	for(f=0;f<n && ok;f++) {
+		fragments += fs_fragments(fs,inumbers[f]);
+	}
+
+	seeks = disk_nseeks(disk);
+	reads = disk_nreads(disk);
+	for(f=0;f<n && ok;f++) {
+		for(offset=0;offset<length;offset+=result) {
+			result = fs_read(fs,inumbers[f],in,READ_CHUNK,offset);
+			if(result<=0) {
+				ok = 0;
+				break;
+			}
+			for(i=0;i<result;i++) {
+				if(in[i]!=(char)(f+(offset+i)/blocksize)) ok = 0;
+			}
+		}
+	}
+	seeks = disk_nseeks(disk)-seeks;
+	reads = disk_nreads(disk)-reads;
+
+	if(ok) {
+		modeled = seeks*SEEK_SECONDS+(double)reads*blocksize/TRANSFER_RATE;
+		printf("%d files of %d blocks: %.1f runs per file, %d seeks to read back, %.1f MB/s modeled\n",
+			n,INTERLEAVE_BLOCKS,(double)fragments/n,seeks,(double)n*length/modeled/1e6);
+	} else {
+		printf("interleave failed\n");
+	}
+
+	for(f=0;f<n;f++) fs_delete(fs,inumbers[f]);
+	free(inumbers);
+	free(out);
+	free(in);
+	return ok;
+}
+
+#define RECORD_MAX 200
+#define GATHER_ROUNDS 10
+
+/*
+Store n small records of random length as one file, first by copying
+them into a single buffer for fs_write and then by handing the records
+to fs_writev as they are, and check both by reading the file back with
+fs_readv into pieces of a different size.
+*/
+
+static int do_bench_gather( struct fs *fs, struct disk *disk, int n )
+{
+	struct iovec *records, *pieces;
+	int i, pass, round, inumber, length = 0, npieces, writes, ok = 1;
+	char *data, *copy, *in;
+	double start;
+
+	if(n<=0) return 0;
+	records = malloc(sizeof(struct iovec)*n);
+	data = malloc((size_t)n*RECORD_MAX);
+	if(!records || !data) {
+		free(records); free(data);
+		return 0;
+	}
+	srand(1);
+	for(i=0;i<n;i++) {
+		records[i].iov_base = data+(size_t)i*RECORD_MAX;
+		records[i].iov_len = 1+rand()%RECORD_MAX;
+		memset(records[i].iov_base,rand(),records[i].iov_len);
+		length += records[i].iov_len;
+	}
+	copy = malloc(length);
+	in = malloc(length);
+	npieces = (length+RECORD_MAX/2-1)/(RECORD_MAX/2);
+	pieces = malloc(sizeof(struct iovec)*npieces);
+	inumber = fs_create(fs);
+	if(!copy || !in || !pieces || inumber<=0) {
+		free(records); free(data); free(copy); free(in); free(pieces);
+		return 0;
+	}
+	for(i=0;i<npieces;i++) {
+		pieces[i].iov_base = in+i*(RECORD_MAX/2);
+		pieces[i].iov_len = i<npieces-1 ? RECORD_MAX/2 : length-i*(RECORD_MAX/2);
+	}
+
+	for(pass=0;pass<2 && ok;pass++) {
+		writes = disk_nwrites(disk);
+		start = now_seconds();
+		for(round=0;round<GATHER_ROUNDS;round++) {
+			if(pass==0) {
+				for(length=0,i=0;i<n;i++) {
+					memcpy(copy+length,records[i].iov_base,records[i].iov_len);
+					length += records[i].iov_len;
+				}
+				if(fs_write(fs,inumber,copy,length,0)!=length) ok = 0;
+			} else {
+				if(fs_writev(fs,inumber,records,n,0)!=length) ok = 0;
+			}
+		}
+		printf("%-6s %d records, %d bytes: %.1f MB/s, %d disk writes each\n",pass ? "writev" : "write",
+			n,length,GATHER_ROUNDS*(double)length/(now_seconds()-start)/1e6,
+			(disk_nwrites(disk)-writes)/GATHER_ROUNDS);
+
+		memset(in,0,length);
+		if(fs_readv(fs,inumber,pieces,npieces,0)!=length) ok = 0;
+		for(length=0,i=0;i<n && ok;i++) {
+			if(memcmp(in+length,records[i].iov_base,records[i].iov_len)) ok = 0;
+			length += records[i].iov_len;
+		}
+	}
+	if(!ok) printf("DATA MISMATCH\n");
+
+	fs_delete(fs,inumber);
+	free(records);
+	free(data);
+	free(copy);
+	free(in);
+	free(pieces);
+	return ok;
+}
+
+/*
+Create n files, give each a block of data, and delete them again, first
+one call per file and then with fs_create_n and fs_delete_n, reporting
+the rate and disk I/O per file of the create and delete phases.
+*/
+
+static int do_bench_batch( struct fs *fs, struct disk *disk, int n )
+{
+	static const char *modes[] = { "single", "batched" };
+	int *inumbers, i, mode, created, deleted, io, blocksize = disk_blocksize(disk), ok = 1;
+	char *data;
+	double start, elapsed;
+
+	if(n<=0) return 0;
+	inumbers = malloc(sizeof(int)*n);
+	data = malloc(blocksize);
+	if(!inumbers || !data) {
+		free(inumbers); free(data);
+		return 0;
+	}
+	memset(data,'x',blocksize);
+
+	for(mode=0;mode<2 && ok;mode++) {
+		io = disk_nreads(disk)+disk_nwrites(disk);
+		start = now_seconds();
+		if(mode==0) {
+			for(created=0;created<n;created++) {
+				inumbers[created] = fs_create(fs);
+				if(inumbers[created]<=0) break;
+			}
+		} else {
+			created = fs_create_n(fs,inumbers,n);
+			if(created<0) created = 0;
+		}
+		elapsed = now_seconds()-start;
+		printf("%-7s create: %d files in %.3f s (%.0f/s), %.2f disk I/Os each\n",modes[mode],created,
+			elapsed,created/(elapsed+1e-9),created ? (double)(disk_nreads(disk)+disk_nwrites(disk)-io)/created : 0.0);
+
+		for(i=0;i<created;i++) {
+			if(fs_write(fs,inumbers[i],data,blocksize,0)!=blocksize) ok = 0;
+		}
+
+		io = disk_nreads(disk)+disk_nwrites(disk);
+		start = now_seconds();
+		if(mode==0) {
+			for(deleted=0;deleted<created;deleted++) {
+				if(fs_delete(fs,inumbers[deleted])!=1) break;
+			}
+			fs_sync(fs); // the reclaimer's share of the work
+		} else {
+			deleted = fs_delete_n(fs,inumbers,created);
+		}
+		elapsed = now_seconds()-start;
+		printf("%-7s delete: %d files in %.3f s (%.0f/s), %.2f disk I/Os each\n",modes[mode],deleted,
+			elapsed,deleted/(elapsed+1e-9),deleted ? (double)(disk_nreads(disk)+disk_nwrites(disk)-io)/deleted : 0.0);
+		if(created<n || deleted<created) ok = 0;
+	}
+
+	free(inumbers);
+	free(data);
+	return ok;
+}
+
+#define FULL_OFFSET_BLOCKS 8	// past the direct pointers of an inode
+
+/*
+Fill the disk, free one block of stale data, then fs_writev n blocks past
+the direct pointers of a new file, so that the indirect block takes the
+last free block and no data fits. The write must come up short and leave
+nothing for fsck to find.
+*/
+
+static int do_bench_full( struct fs *fs, struct disk *disk, int n )
+{
+	struct fs_stats stats;
+	struct iovec iov;
+	int blocksize = disk_blocksize(disk);
+	int *files, nfiles = 0, count = 0, offset, inumber, written, problems, ok = 1;
+	char *data;
+
+	if(n<=0 || !fs_statfs(fs,&stats)) return 0;
+	files = malloc(sizeof(int)*stats.total_inodes);
+	data = malloc((size_t)n*blocksize);
+	if(!files || !data) {
+		free(files); free(data);
+		return 0;
+	}
+	memset(data,'f',(size_t)n*blocksize);
+
+	// every block differs, so dedup cannot share them
+	while(stats.free_blocks>0) {
+		inumber = fs_create(fs);
+		if(inumber<=0) break;
+		files[nfiles++] = inumber;
+		for(offset=0;stats.free_blocks>0;offset+=blocksize) {
+			count++;
+			memcpy(data,&count,sizeof(count));
+			if(fs_write(fs,inumber,data,blocksize,offset)!=blocksize) break;
+			fs_statfs(fs,&stats);
+		}
+		if(offset==0) break;
+	}
+	if(nfiles>0 && offset>0) {
+		fs_truncate(fs,files[nfiles-1],offset-blocksize);
+	}
+	fs_statfs(fs,&stats);
+	printf("filled %d files, %d blocks free\n",nfiles,stats.free_blocks);
+
+	inumber = fs_create(fs);
+	if(inumber<=0) {
+		ok = 0;
+	} else {
+		iov.iov_base = data;
+		iov.iov_len = (size_t)n*blocksize;
+		written = fs_writev(fs,inumber,&iov,1,FULL_OFFSET_BLOCKS*blocksize);
+		printf("writev of %d blocks past the direct pointers wrote %d bytes\n",n,written);
+		if(written==n*blocksize) ok = 0;
+		files[nfiles++] = inumber;
+	}
+	problems = fs_fsck(fs,0);
+	if(problems!=0) ok = 0;
+
+	fs_delete_n(fs,files,nfiles);
+	free(files);
+	free(data);
+	return ok;
+}
+
+static int do_bench( struct fs *fs, struct disk *disk, const char *name, int n )
+{
+	if(!strcmp(name,"churn")) {
+		return do_bench_churn(fs,disk,n);
+	} else if(!strcmp(name,"stress")) {
+		return do_bench_stress(fs,n);
+	} else if(!strcmp(name,"read")) {
+		return do_bench_read(fs,n);
+	} else if(!strcmp(name,"names")) {
+		return do_bench_names(fs,disk,n);
+	} else if(!strcmp(name,"compress")) {
+		return do_bench_compress(fs,disk,n);
+	} else if(!strcmp(name,"interleave")) {
+		return do_bench_interleave(fs,disk,n);
+	} else if(!strcmp(name,"gather")) {
+		return do_bench_gather(fs,disk,n);
+	} else if(!strcmp(name,"scan")) {
+		return do_bench_scan(fs,n);
+	} else if(!strcmp(name,"batch")) {
+		return do_bench_batch(fs,disk,n);
+	} else if(!strcmp(name,"full")) {
+		return do_bench_full(fs,disk,n);
+	} else {
+		printf("unknown benchmark: %s\n",name);
+		return 0;
+	}
+}